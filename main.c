@@ -3,14 +3,35 @@
 #include <stdbool.h>
 #include <math.h>
 #include <time.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #include "raylib.h"
 #include "raymath.h"
 
+#ifdef __EMSCRIPTEN__
 #include <emscripten/emscripten.h>
+#else
+// Native build (headless replays), nothing is called from a page
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 
 // Compilation
 // emcc -o game.html main.c -Os -Wall /opt/webRaylib/raylib-master/src/web/libraylib.a -I. -I /opt/webRaylib/raylib-master/src -L. -L /opt/webRaylib/raylib-master/src/web -s USE_GLFW=3 --shell-file ./shell.html -DPLATFORM_WEB -sGL_ENABLE_GET_PROC_ADDRESS --preload-file mapImages -s ALLOW_MEMORY_GROWTH=1 -s NO_EXIT_RUNTIME=1 -s 'EXPORTED_RUNTIME_METHODS=[ccall]'
+// This build runs the visibility computation and floor prefetching inside the frame, and the PVS build a slice per frame.
+// Threads are opt-in: add -pthread -s PTHREAD_POOL_SIZE=2 to move them to workers. That build only starts when the page
+// is served with "Cross-Origin-Opener-Policy: same-origin" and "Cross-Origin-Embedder-Policy: require-corp"
+// (SharedArrayBuffer), so only use it where the server sends those headers
+
+// Native build, for replaying recorded sessions at full speed
+// cc -o darkvision main.c -O2 -Wall -I /opt/raylib/src -L /opt/raylib/src -lraylib -lm -lpthread -ldl
+// ./darkvision --replay session.dvin    (headless, prints total, average and slowest frame time, exits when done)
+// ./darkvision --record session.dvin    (normal window, saved on close)
 
 // Screen dimensions
 int screenWidth = 1000;
@@ -20,159 +41,2703 @@ int screenHeight = 1000;
 short gameBoardGridWidth = 16;
 short gameBoardGridHeight = 28;
 
-// Tile size (automatically calculated)
-float tileSize = 20;
+// Tile size (automatically calculated)
+float tileSize = 20;
+
+// Distance from a point to be considered as the point
+int mouseSensitivityDistance = 6;
+// Mouse position
+int mousePositionX = 0;
+int mousePositionY = 0;
+int mousePositionXOld = 0;
+int mousePositionYOld = 0;
+
+// If the mouse is over a corner/wall node
+bool isMouseOverCorner = false;
+
+// Read the name
+typedef enum MAPEDITORMODE
+{
+    MAP_NONE,
+    MAP_PLACEWALLS,
+    MAP_PLAY
+} MAPEDITORMODE;
+MAPEDITORMODE mapEditorMode = MAP_PLACEWALLS;
+
+// If the first vertex of a wall has been placed
+bool wallPlacementStarted = false;
+// If box selection has been started
+bool boxSelectionStarted = false;
+
+typedef enum WALLSTATE
+{
+    WALL_NONE,
+    WALL_PLACED,
+    WALL_MARKED
+} WALLSTATE;
+
+// Wall struct
+typedef struct Wall
+{
+    WALLSTATE state;
+    short startX;
+    short startY;
+    short endX;
+    short endY;
+} WALL;
+
+// Wall color
+bool wallColorToggle = true;
+
+// Wall variable
+const short maxWallCount = 512;
+WALL walls[512];
+short placeWallIndex = 0;
+short selectedWallIndex = -1;
+
+// Bitwise boolean conditions array
+typedef enum BITCONDITION
+{
+    CON_DEAD = 1,
+    CON_BLIND = 1 << 1,
+    CON_CHARMED = 1 << 2,
+    CON_DEAFENED = 1 << 3,
+    CON_FRIGHTENED = 1 << 4,
+    CON_GRAPPLED = 1 << 5,
+    CON_INCAPACITATED = 1 << 6,
+    CON_INVISIBLE = 1 << 7,
+    CON_PARALYZED = 1 << 8,
+    CON_PETRIFIED = 1 << 9,
+    CON_POISONED = 1 << 10,
+    CON_PRONE = 1 << 11,
+    CON_RESTRAINED = 1 << 12,
+    CON_STUNNED = 1 << 13,
+    CON_UNCONSCIOUS = 1 << 14,
+    CON_EXTRA_01 = 1 << 15,
+    CON_EXTRA_02 = 1 << 16,
+    CON_EXTRA_03 = 1 << 17,
+    CON_EXTRA_04 = 1 << 18,
+    CON_EXTRA_05 = 1 << 19,
+    CON_EXTRA_06 = 1 << 20,
+    CON_EXTRA_07 = 1 << 21,
+    CON_EXTRA_08 = 1 << 22,
+    CON_EXTRA_09 = 1 << 23,
+    CON_EXTRA_10 = 1 << 24,
+    CON_EXTRA_11 = 1 << 25,
+    CON_EXTRA_12 = 1 << 26,
+    CON_EXTRA_13 = 1 << 27,
+    CON_EXTRA_14 = 1 << 28,
+    CON_EXTRA_15 = 1 << 29,
+    CON_EXTRA_16 = 1 << 30,
+    CON_EXTRA_17 = 1 << 31
+} BITCONDITION;
+
+typedef enum TOKENSTATE
+{
+    TOKEN_NONE,
+    TOKEN_PLACED,
+    TOKEN_HOVER,
+    TOKEN_SELECTED
+} TOKENSTATE;
+
+// Token struct
+typedef struct Token
+{
+    TOKENSTATE state;
+    short x;
+    short y;
+    char width;
+    char height;
+    uint32_t bitConditions;
+    Color color;
+} TOKEN;
+
+// Token variable
+const short maxTokenCount = 512;
+TOKEN tokens[512];
+short activeToken = -1;
+
+bool drawFov = true;
+
+// Map texture
+Texture2D mapTexture;
+const char *mapImagePath = "mapImages/The_handy_hag_upstairs.png";
+// Map image pixels to screen pixels
+float mapTextureScale = 0.5f;
+
+// Native replays run without a window or GL context, nothing is drawn or uploaded
+bool headless = false;
+
+static inline int max(int a, int b)
+{
+    return (a > b) * a + (a <= b) * b;
+}
+
+static inline int min(int a, int b)
+{
+    return (a < b) * a + (a >= b) * b;
+}
+
+// Point rectangle collision
+static inline bool PointRectCollision(int x, int y, int rx, int ry, int rx2, int ry2)
+{
+    return x >= min(rx, rx2) &&
+           x <= max(rx, rx2) &&
+           y >= min(ry, ry2) &&
+           y <= max(ry, ry2);
+}
+
+// Seconds on a monotonic clock (raylib's GetTime needs a window)
+double ProfileTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Shadow quad struct (pixel coordinates)
+// Drawn as the fan (0, 1, 2), (0, 2, 3), already wound the way DrawTriangle wants
+typedef struct ShadowQuad
+{
+    Vector2 points[4];
+} SHADOWQUAD;
+
+// Copy of everything the visibility computation reads
+typedef struct VisibilitySnapshot
+{
+    WALL walls[512];
+    TOKEN token;
+    bool hasToken;
+    short gridWidth;
+    short gridHeight;
+    float tileSize;
+    uint32_t wallHash;
+} VISIBILITYSNAPSHOT;
+
+// Shadows computed from one snapshot
+typedef struct VisibilityResult
+{
+    short quadCount;
+    SHADOWQUAD quads[512];
+} VISIBILITYRESULT;
+
+// Visibility pipeline (double buffered)
+// The main thread only writes the snapshot while the worker is idle,
+// the worker only writes the back buffer and then publishes it by flipping the front index
+VISIBILITYSNAPSHOT visibilitySnapshot;
+VISIBILITYSNAPSHOT visibilityScratch;
+VISIBILITYRESULT visibilityResults[2];
+atomic_int visibilityFrontIndex = 0;
+atomic_bool visibilityWorkerBusy = false;
+bool visibilitySnapshotValid = false;
+bool visibilityAsync = false;
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+pthread_t visibilityThread;
+sem_t visibilityJobSemaphore;
+#endif
+
+// Exact integer geometry
+// Visibility works in half tile units (grid coordinate * 2) so token centres are integers too,
+// every predicate below is exact (64 bit products) and gives the same answer in every build
+typedef struct GridPoint
+{
+    int x;
+    int y;
+} GRIDPOINT;
+
+static inline GRIDPOINT HalfTilePoint(short x, short y)
+{
+    return (GRIDPOINT){x * 2, y * 2};
+}
+
+// Sign of the cross product (b - a) x (c - a): 1, -1 or 0 when collinear
+// y points down on screen, so 1 is clockwise as drawn
+static inline int Orientation(GRIDPOINT a, GRIDPOINT b, GRIDPOINT c)
+{
+    int64_t cross =
+        (int64_t)(b.x - a.x) * (c.y - a.y) -
+        (int64_t)(b.y - a.y) * (c.x - a.x);
+    return (cross > 0) - (cross < 0);
+}
+
+// If p is within the bounding box of segment ab (only meaningful when p is collinear with ab)
+static inline bool PointInSegmentBox(GRIDPOINT p, GRIDPOINT a, GRIDPOINT b)
+{
+    return PointRectCollision(p.x, p.y, a.x, a.y, b.x, b.y);
+}
+
+// Segment ab against segment cd
+// proper: only count crossings through both interiors, touching endpoints and collinear overlap don't block
+bool SegmentsIntersect(GRIDPOINT a, GRIDPOINT b, GRIDPOINT c, GRIDPOINT d, bool proper)
+{
+    int o1 = Orientation(a, b, c);
+    int o2 = Orientation(a, b, d);
+    // cd entirely on one side of ab, skip the other two orientations
+    if (o1 * o2 > 0 || (proper && o1 * o2 == 0))
+        return false;
+
+    int o3 = Orientation(c, d, a);
+    int o4 = Orientation(c, d, b);
+
+    if (o1 * o2 < 0 && o3 * o4 < 0)
+        return true;
+    if (proper)
+        return false;
+
+    return (o1 == 0 && PointInSegmentBox(c, a, b)) ||
+           (o2 == 0 && PointInSegmentBox(d, a, b)) ||
+           (o3 == 0 && PointInSegmentBox(a, c, d)) ||
+           (o4 == 0 && PointInSegmentBox(b, c, d));
+}
+
+// How far to push a wall's ends away from the eye so its shadow covers the rest of the board
+// The far edge of the shadow is parallel to the wall, (extension + 1) times the eye's distance to the
+// wall's line away from the eye, so it has to be pushed past the farthest board corner
+static inline double ShadowExtension(GRIDPOINT eye, GRIDPOINT a, GRIDPOINT b, double farthestCorner)
+{
+    int64_t cross =
+        (int64_t)(a.x - eye.x) * (b.y - eye.y) -
+        (int64_t)(a.y - eye.y) * (b.x - eye.x);
+    double wallLength = hypot(b.x - a.x, b.y - a.y);
+    return ceil(farthestCorner * wallLength / fabs((double)cross));
+}
+
+// Push p away from the eye along the ray eye->p, straight to pixels
+// (walls seen nearly edge on get a huge extension, so this stays out of int)
+static inline Vector2 FoVEndpoint(GRIDPOINT eye, GRIDPOINT p, double extension, float tileSize)
+{
+    return (Vector2){
+        (float)((p.x + extension * (p.x - eye.x)) * tileSize * 0.5),
+        (float)((p.y + extension * (p.y - eye.y)) * tileSize * 0.5)};
+}
+
+static inline Vector2 HalfTileToPixels(GRIDPOINT p, float tileSize)
+{
+    return (Vector2){p.x * tileSize * 0.5f, p.y * tileSize * 0.5f};
+}
+
+// Potentially visible set (PVS)
+// Built once the walls are done (entering MAP_PLAY) and saved next to the map image.
+// One entry per eye position in half tile units, (2 * width + 1) * (2 * height + 1) of them,
+// which covers every cell centre, edge and corner a token centre can land on.
+// Each entry is a bitset of the walls that might be seen from there
+typedef struct PotentiallyVisibleSet
+{
+    bool valid;
+    short gridWidth;
+    short gridHeight;
+    uint32_t wallHash;
+    int eyeCount;
+    int wallWords;
+    uint32_t *wallBits;
+} PVS;
+
+PVS pvs;
+
+const char *mapPvsPath = "mapImages/The_handy_hag_upstairs.pvs";
+
+// Identifies a wall layout so stale PVS data is never used
+uint32_t HashWalls(const WALL *wallList)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (short i = 0; i < maxWallCount; i++)
+    {
+        short values[5] = {
+            wallList[i].state != WALL_NONE,
+            wallList[i].state ? wallList[i].startX : 0,
+            wallList[i].state ? wallList[i].startY : 0,
+            wallList[i].state ? wallList[i].endX : 0,
+            wallList[i].state ? wallList[i].endY : 0};
+        for (short ii = 0; ii < 5; ii++)
+        {
+            hash = (hash ^ (uint16_t)values[ii]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+static inline bool BitsetGet(const uint32_t *bits, int index)
+{
+    return (bits[index >> 5] >> (index & 31)) & 1u;
+}
+
+static inline void BitsetSet(uint32_t *bits, int index)
+{
+    bits[index >> 5] |= 1u << (index & 31);
+}
+
+// Eye position (half tile units) to PVS entry, -1 when off the board
+static inline int PvsEyeIndex(const PVS *set, GRIDPOINT eye)
+{
+    if (eye.x < 0 || eye.y < 0 || eye.x > set->gridWidth * 2 || eye.y > set->gridHeight * 2)
+        return -1;
+    return eye.y * (set->gridWidth * 2 + 1) + eye.x;
+}
+
+void FreePotentiallyVisibleSet(PVS *set)
+{
+    free(set->wallBits);
+    *set = (PVS){0};
+}
+
+bool AllocatePotentiallyVisibleSet(PVS *set, short gridWidth, short gridHeight)
+{
+    FreePotentiallyVisibleSet(set);
+    set->gridWidth = gridWidth;
+    set->gridHeight = gridHeight;
+    set->eyeCount = (gridWidth * 2 + 1) * (gridHeight * 2 + 1);
+    set->wallWords = (maxWallCount + 31) / 32;
+    set->wallBits = calloc((size_t)set->eyeCount * set->wallWords, sizeof(uint32_t));
+    if (!set->wallBits)
+    {
+        FreePotentiallyVisibleSet(set);
+        return false;
+    }
+    return true;
+}
+
+// Placed walls packed together, so the PVS build doesn't walk the empty slots for every sight line
+typedef struct WallList
+{
+    short count;
+    short index[512];
+    GRIDPOINT start[512];
+    GRIDPOINT end[512];
+} WALLLIST;
+
+void PackWalls(const WALL *wallList, WALLLIST *packed)
+{
+    packed->count = 0;
+    for (short i = 0; i < maxWallCount; i++)
+    {
+        if (!wallList[i].state)
+            continue;
+
+        packed->index[packed->count] = i;
+        packed->start[packed->count] = (GRIDPOINT){wallList[i].startX, wallList[i].startY};
+        packed->end[packed->count] = (GRIDPOINT){wallList[i].endX, wallList[i].endY};
+        packed->count++;
+    }
+}
+
+// Part of a wall hidden behind another one, as a range along it (0 at its start, 1 at its end)
+typedef struct HiddenSpan
+{
+    double from;
+    double to;
+} HIDDENSPAN;
+
+int CompareHiddenSpans(const void *a, const void *b)
+{
+    double fromA = ((const HIDDENSPAN *)a)->from;
+    double fromB = ((const HIDDENSPAN *)b)->from;
+    return (fromA > fromB) - (fromA < fromB);
+}
+
+// Narrow [from, to] along a segment to where a function going linearly from atStart to atEnd is >= 0
+// Returns false if nothing but a point (or less) is left
+static inline bool ClipSpan(double atStart, double atEnd, double *from, double *to)
+{
+    if (atStart < 0 && atEnd < 0)
+        return false;
+    if (atStart < 0)
+        *from = fmax(*from, atStart / (atStart - atEnd));
+    else if (atEnd < 0)
+        *to = fmin(*to, atStart / (atStart - atEnd));
+    return *from < *to;
+}
+
+// What every wall looks like from one eye, so each wall is only clipped against walls that can be in front of it
+// Skipping a wall that could hide something only ever keeps more walls visible, so none of this has to be exact
+#define PVS_ANGLE_BUCKETS 64
+typedef struct EyeView
+{
+    // Directions a wall covers, anticlockwise from angleFrom for angleWidth radians (negative when seen edge on)
+    double angleFrom[512];
+    double angleWidth[512];
+    // Distance from the eye to the nearest and farthest point of each wall
+    double nearest[512];
+    double farthest[512];
+    // Walls covering each slice of the full turn (bucketStart[k] to bucketStart[k + 1] in bucketWalls)
+    int bucketStart[PVS_ANGLE_BUCKETS + 1];
+    short bucketWalls[512 * (PVS_ANGLE_BUCKETS / 2 + 2)];
+    // Walls already looked at for the current wall
+    bool seen[512];
+} EYEVIEW;
+
+// Slice of the turn an angle (from -pi up) falls in, not wrapped so a range can be walked upwards
+static inline int AngleBucket(double angle)
+{
+    return (int)floor((angle + M_PI) / (2 * M_PI) * PVS_ANGLE_BUCKETS);
+}
+
+void PrepareEyeView(GRIDPOINT eye, const WALLLIST *packed, EYEVIEW *view)
+{
+    int bucketFill[PVS_ANGLE_BUCKETS] = {0};
+    for (short i = 0; i < packed->count; i++)
+    {
+        double ax = packed->start[i].x * 2 - eye.x;
+        double ay = packed->start[i].y * 2 - eye.y;
+        double bx = packed->end[i].x * 2 - eye.x;
+        double by = packed->end[i].y * 2 - eye.y;
+
+        double lengthSquared = (bx - ax) * (bx - ax) + (by - ay) * (by - ay);
+        double t = lengthSquared > 0 ? fmin(fmax(-(ax * (bx - ax) + ay * (by - ay)) / lengthSquared, 0), 1) : 0;
+        view->nearest[i] = hypot(ax + t * (bx - ax), ay + t * (by - ay));
+        view->farthest[i] = fmax(hypot(ax, ay), hypot(bx, by));
+
+        double cross = ax * by - ay * bx;
+        view->angleWidth[i] = -1;
+        if (cross == 0)
+            continue;
+        double angleA = atan2(ay, ax);
+        double angleB = atan2(by, bx);
+        view->angleFrom[i] = cross > 0 ? angleA : angleB;
+        view->angleWidth[i] = fabs(angleB - angleA);
+        if (view->angleWidth[i] > M_PI)
+            view->angleWidth[i] = 2 * M_PI - view->angleWidth[i];
+
+        for (int k = AngleBucket(view->angleFrom[i]); k <= AngleBucket(view->angleFrom[i] + view->angleWidth[i]); k++)
+        {
+            bucketFill[k % PVS_ANGLE_BUCKETS]++;
+        }
+    }
+
+    view->bucketStart[0] = 0;
+    for (int k = 0; k < PVS_ANGLE_BUCKETS; k++)
+    {
+        view->bucketStart[k + 1] = view->bucketStart[k] + bucketFill[k];
+        bucketFill[k] = view->bucketStart[k];
+    }
+    for (short i = 0; i < packed->count; i++)
+    {
+        if (view->angleWidth[i] < 0)
+            continue;
+        for (int k = AngleBucket(view->angleFrom[i]); k <= AngleBucket(view->angleFrom[i] + view->angleWidth[i]); k++)
+        {
+            view->bucketWalls[bucketFill[k % PVS_ANGLE_BUCKETS]++] = i;
+        }
+    }
+}
+
+// If any part of the wall can be seen from the eye (half tile units)
+// Every other wall hides a range of this one: the part of it on the eye's side of this wall,
+// inside the view of this wall, projected onto it. The wall is hidden when those ranges cover it
+bool IsWallPotentiallyVisible(GRIDPOINT eye, short wall, const WALLLIST *packed, EYEVIEW *view, HIDDENSPAN *spans)
+{
+    GRIDPOINT a = HalfTilePoint(packed->start[wall].x, packed->start[wall].y);
+    GRIDPOINT b = HalfTilePoint(packed->end[wall].x, packed->end[wall].y);
+    int side = Orientation(a, b, eye);
+    // Seen edge on (or the eye is on it), it casts no shadow either way
+    if (side == 0)
+        return false;
+
+    // Relative to the eye from here on
+    double ax = a.x - eye.x;
+    double ay = a.y - eye.y;
+    double bx = b.x - eye.x;
+    double by = b.y - eye.y;
+
+    // Only walls in the same directions, and nearer than its far end, can be in front of it
+    memset(view->seen, 0, packed->count * sizeof(bool));
+    int spanCount = 0;
+    int lastBucket = AngleBucket(view->angleFrom[wall] + view->angleWidth[wall]);
+    for (int k = AngleBucket(view->angleFrom[wall]); k <= lastBucket; k++)
+    {
+        int bucket = k % PVS_ANGLE_BUCKETS;
+        for (int j = view->bucketStart[bucket]; j < view->bucketStart[bucket + 1]; j++)
+        {
+            short i = view->bucketWalls[j];
+            if (view->seen[i])
+                continue;
+            view->seen[i] = true;
+            if (i == wall || view->nearest[i] >= view->farthest[wall])
+                continue;
+            GRIDPOINT c = HalfTilePoint(packed->start[i].x, packed->start[i].y);
+            GRIDPOINT d = HalfTilePoint(packed->end[i].x, packed->end[i].y);
+            // Walls behind it hide nothing
+            if (Orientation(a, b, c) * side <= 0 && Orientation(a, b, d) * side <= 0)
+                continue;
+
+            double cx = c.x - eye.x;
+            double cy = c.y - eye.y;
+            double dx = d.x - eye.x;
+            double dy = d.y - eye.y;
+
+            // Eye's side of the wall's line, then between the sight lines to its ends
+            double from = 0;
+            double to = 1;
+            if (!ClipSpan(
+                    ((bx - ax) * (cy - ay) - (by - ay) * (cx - ax)) * side,
+                    ((bx - ax) * (dy - ay) - (by - ay) * (dx - ax)) * side,
+                    &from, &to) ||
+                !ClipSpan((ax * cy - ay * cx) * side, (ax * dy - ay * dx) * side, &from, &to) ||
+                !ClipSpan((cx * by - cy * bx) * side, (dx * by - dy * bx) * side, &from, &to))
+                continue;
+
+            // Where the sight lines through both ends of what's left meet the wall
+            double spanEnds[2];
+            double along[2] = {from, to};
+            for (short e = 0; e < 2; e++)
+            {
+                double px = cx + (dx - cx) * along[e];
+                double py = cy + (dy - cy) * along[e];
+                spanEnds[e] = (px * ay - py * ax) / ((bx - ax) * py - (by - ay) * px);
+            }
+            spans[spanCount++] = (HIDDENSPAN){fmin(spanEnds[0], spanEnds[1]), fmax(spanEnds[0], spanEnds[1])};
+        }
+    }
+
+    // Sweep along the wall, a gap is a way to see it (gaps down at rounding size can't be seen)
+    qsort(spans, spanCount, sizeof(HIDDENSPAN), CompareHiddenSpans);
+    double hiddenTo = 0;
+    for (int i = 0; i < spanCount; i++)
+    {
+        if (spans[i].from > hiddenTo + 1e-9)
+            return true;
+        hiddenTo = fmax(hiddenTo, spans[i].to);
+    }
+    return hiddenTo < 1 - 1e-9;
+}
+
+// A PVS being built a slice at a time, so building one never stalls a frame
+typedef struct PvsBuild
+{
+    bool active;
+    PVS set;
+    uint32_t wallHash;
+    int nextEye;
+    WALLLIST packed;
+    EYEVIEW view;
+    HIDDENSPAN spans[512];
+} PVSBUILD;
+
+PVSBUILD pvsBuild;
+// Seconds of each frame the main thread spends on the PVS build
+double pvsBuildFrameTime = 0.004;
+// Set when the floor prefetch worker is running, it builds the current floor's PVS instead of the main thread
+bool pvsBuildOnWorker = false;
+
+void CancelPotentiallyVisibleSetBuild(PVSBUILD *build)
+{
+    FreePotentiallyVisibleSet(&build->set);
+    build->active = false;
+}
+
+bool StartPotentiallyVisibleSetBuild(PVSBUILD *build, const WALL *wallList, short gridWidth, short gridHeight)
+{
+    CancelPotentiallyVisibleSetBuild(build);
+    if (!AllocatePotentiallyVisibleSet(&build->set, gridWidth, gridHeight))
+        return false;
+
+    PackWalls(wallList, &build->packed);
+    build->wallHash = HashWalls(wallList);
+    build->nextEye = 0;
+    build->active = true;
+    return true;
+}
+
+// Carry on with the build for up to timeLimit seconds (no limit if negative)
+// Returns true when this call finished it, the set is then valid
+bool StepPotentiallyVisibleSetBuild(PVSBUILD *build, double timeLimit)
+{
+    if (!build->active)
+        return false;
+
+    PVS *set = &build->set;
+    int rowLength = set->gridWidth * 2 + 1;
+    double endTime = ProfileTime() + timeLimit;
+    while (build->nextEye < set->eyeCount)
+    {
+        GRIDPOINT eye = (GRIDPOINT){build->nextEye % rowLength, build->nextEye / rowLength};
+        uint32_t *wallBits = &set->wallBits[(size_t)build->nextEye * set->wallWords];
+        PrepareEyeView(eye, &build->packed, &build->view);
+        for (short i = 0; i < build->packed.count; i++)
+        {
+            if (IsWallPotentiallyVisible(eye, i, &build->packed, &build->view, build->spans))
+                BitsetSet(wallBits, build->packed.index[i]);
+        }
+        build->nextEye++;
+
+        if (timeLimit >= 0 && ProfileTime() >= endTime)
+            break;
+    }
+    if (build->nextEye < set->eyeCount)
+        return false;
+
+    set->wallHash = build->wallHash;
+    set->valid = true;
+    build->active = false;
+    return true;
+}
+
+// The whole build in one go
+bool BuildPotentiallyVisibleSet(PVS *set, const WALL *wallList, short gridWidth, short gridHeight)
+{
+    // Off the stack (the browser main thread's is small) and not static, floors get built on the prefetch thread too
+    PVSBUILD *build = calloc(1, sizeof(PVSBUILD));
+    if (!build)
+        return false;
+
+    bool built =
+        StartPotentiallyVisibleSetBuild(build, wallList, gridWidth, gridHeight) &&
+        StepPotentiallyVisibleSetBuild(build, -1);
+    if (built)
+    {
+        FreePotentiallyVisibleSet(set);
+        *set = build->set;
+        build->set = (PVS){0};
+    }
+    CancelPotentiallyVisibleSetBuild(build);
+    free(build);
+    return built;
+}
+
+// If the PVS belongs to this wall layout and board
+static inline bool IsPvsUsable(const PVS *set, uint32_t wallHash, short gridWidth, short gridHeight)
+{
+    return set->valid &&
+           set->wallHash == wallHash &&
+           set->gridWidth == gridWidth &&
+           set->gridHeight == gridHeight;
+}
+
+// PVS file: "DVPV", version, grid size, wall hash, then the wall bitsets run length encoded
+// as (run length, word) pairs since most neighbouring eyes see the same thing
+const uint32_t pvsFileMagic = 0x56505644; // "DVPV"
+const uint32_t pvsFileVersion = 2;
+
+void WriteRunLengthWords(FILE *file, const uint32_t *words, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        uint32_t run = 1;
+        while (i + run < count && words[i + run] == words[i] && run < UINT32_MAX)
+        {
+            run++;
+        }
+        fwrite(&run, sizeof(run), 1, file);
+        fwrite(&words[i], sizeof(words[i]), 1, file);
+        i += run;
+    }
+}
+
+bool ReadRunLengthWords(FILE *file, uint32_t *words, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        uint32_t run;
+        uint32_t word;
+        if (fread(&run, sizeof(run), 1, file) != 1 ||
+            fread(&word, sizeof(word), 1, file) != 1 ||
+            run == 0 || run > count - i)
+            return false;
+        for (uint32_t ii = 0; ii < run; ii++)
+        {
+            words[i++] = word;
+        }
+    }
+    return true;
+}
+
+bool SavePotentiallyVisibleSet(const PVS *set, const char *path)
+{
+    if (!set->valid)
+        return false;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    fwrite(&pvsFileMagic, sizeof(pvsFileMagic), 1, file);
+    fwrite(&pvsFileVersion, sizeof(pvsFileVersion), 1, file);
+    fwrite(&set->gridWidth, sizeof(set->gridWidth), 1, file);
+    fwrite(&set->gridHeight, sizeof(set->gridHeight), 1, file);
+    fwrite(&set->wallHash, sizeof(set->wallHash), 1, file);
+    WriteRunLengthWords(file, set->wallBits, (size_t)set->eyeCount * set->wallWords);
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool LoadPotentiallyVisibleSet(PVS *set, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    short gridWidth = 0;
+    short gridHeight = 0;
+    uint32_t wallHash = 0;
+    bool ok =
+        fread(&magic, sizeof(magic), 1, file) == 1 && magic == pvsFileMagic &&
+        fread(&version, sizeof(version), 1, file) == 1 && version == pvsFileVersion &&
+        fread(&gridWidth, sizeof(gridWidth), 1, file) == 1 && gridWidth > 0 &&
+        fread(&gridHeight, sizeof(gridHeight), 1, file) == 1 && gridHeight > 0 &&
+        fread(&wallHash, sizeof(wallHash), 1, file) == 1 &&
+        AllocatePotentiallyVisibleSet(set, gridWidth, gridHeight) &&
+        ReadRunLengthWords(file, set->wallBits, (size_t)set->eyeCount * set->wallWords);
+    fclose(file);
+
+    if (!ok)
+    {
+        FreePotentiallyVisibleSet(set);
+        return false;
+    }
+    set->wallHash = wallHash;
+    set->valid = true;
+    return true;
+}
+
+// Rooms and portals
+// Cells are flood filled into rooms, split by the walls and by door gaps (portals).
+// A portal is a short gap that carries on from a wall end until it meets another wall or the board edge.
+// Visibility walks from the token's room through the portals it can see through, narrowing the view
+// each time, and only the walls around the rooms it reaches cast shadows. Every sight line out of
+// those rooms either leaves through a wall of theirs or through a portal that got walked, so nothing
+// visible is missed
+typedef struct Portal
+{
+    // Half tile units
+    GRIDPOINT start;
+    GRIDPOINT end;
+    int roomA;
+    int roomB;
+} PORTAL;
+
+// One step of the portal walk, the view is the angle from left to right around the eye
+typedef struct RoomVisit
+{
+    int room;
+    // Portal the walk came in through, -1 for the rooms the eye is in
+    int entryPortal;
+    bool fullView;
+    GRIDPOINT left;
+    GRIDPOINT right;
+    int depth;
+} ROOMVISIT;
+
+typedef struct RoomGraph
+{
+    bool valid;
+    short gridWidth;
+    short gridHeight;
+    uint32_t wallHash;
+    int roomCount;
+    int *cellRoom;
+    int portalCount;
+    PORTAL *portals;
+    // Portals of each room (roomPortalStart[room] to roomPortalStart[room + 1] in roomPortals)
+    int *roomPortalStart;
+    int *roomPortals;
+    // Bitset of the walls touching each room
+    int wallWords;
+    uint32_t *roomWalls;
+    // Walk scratch space (only ever used by whoever runs ComputeVisibility)
+    uint32_t *roomVisited;
+    ROOMVISIT *visitStack;
+    int visitStackCapacity;
+    // Widest view walked through each portal so far, both ways (portal * 2 + 1 is into roomB)
+    ROOMVISIT *portalViews;
+} ROOMGRAPH;
+
+ROOMGRAPH roomGraph;
+
+// Widest gap (in tiles) that counts as a door
+short maxPortalWidth = 3;
+
+void FreeRoomGraph(ROOMGRAPH *graph)
+{
+    free(graph->cellRoom);
+    free(graph->portals);
+    free(graph->roomPortalStart);
+    free(graph->roomPortals);
+    free(graph->roomWalls);
+    free(graph->roomVisited);
+    free(graph->visitStack);
+    free(graph->portalViews);
+    *graph = (ROOMGRAPH){0};
+}
+
+// If p (half tile units) is on any wall or the board edge
+bool IsPortalStop(GRIDPOINT p, const WALLLIST *packed, short gridWidth, short gridHeight)
+{
+    if (p.x <= 0 || p.y <= 0 || p.x >= gridWidth * 2 || p.y >= gridHeight * 2)
+        return true;
+
+    for (short i = 0; i < packed->count; i++)
+    {
+        GRIDPOINT a = (GRIDPOINT){packed->start[i].x * 2, packed->start[i].y * 2};
+        GRIDPOINT b = (GRIDPOINT){packed->end[i].x * 2, packed->end[i].y * 2};
+        if (Orientation(a, b, p) == 0 && PointInSegmentBox(p, a, b))
+            return true;
+    }
+    return false;
+}
+
+// If nothing touches the inside of the gap a-b (half tile units), only its ends may touch walls
+bool IsPortalGapClear(GRIDPOINT a, GRIDPOINT b, const WALLLIST *packed)
+{
+    // Quarter tiles, pulled in by a quarter tile at both ends
+    GRIDPOINT direction = (GRIDPOINT){(b.x > a.x) - (b.x < a.x), (b.y > a.y) - (b.y < a.y)};
+    GRIDPOINT from = (GRIDPOINT){a.x * 2 + direction.x, a.y * 2 + direction.y};
+    GRIDPOINT to = (GRIDPOINT){b.x * 2 - direction.x, b.y * 2 - direction.y};
+
+    for (short i = 0; i < packed->count; i++)
+    {
+        if (SegmentsIntersect(
+                from, to,
+                (GRIDPOINT){packed->start[i].x * 4, packed->start[i].y * 4},
+                (GRIDPOINT){packed->end[i].x * 4, packed->end[i].y * 4},
+                false))
+            return false;
+    }
+    return true;
+}
+
+// Carry the wall on past its end (end, coming from the other end) and record the gap as a portal
+void FindPortal(GRIDPOINT from, GRIDPOINT end, const WALLLIST *packed, short gridWidth, short gridHeight,
+                PORTAL *portals, int *portalCount, int portalCapacity)
+{
+    int dx = end.x - from.x;
+    int dy = end.y - from.y;
+    if (dx == 0 && dy == 0)
+        return;
+
+    // Smallest grid step along the wall
+    int divisor = 1;
+    for (int d = max(abs(dx), abs(dy)); d > 1; d--)
+    {
+        if (dx % d == 0 && dy % d == 0)
+        {
+            divisor = d;
+            break;
+        }
+    }
+    GRIDPOINT step = (GRIDPOINT){dx / divisor * 2, dy / divisor * 2};
+    int stepLengthSquared = step.x * step.x + step.y * step.y;
+
+    GRIDPOINT start = (GRIDPOINT){end.x * 2, end.y * 2};
+    for (int t = 1; t * t * stepLengthSquared <= maxPortalWidth * maxPortalWidth * 4; t++)
+    {
+        GRIDPOINT p = (GRIDPOINT){start.x + step.x * t, start.y + step.y * t};
+        if (p.x < 0 || p.y < 0 || p.x > gridWidth * 2 || p.y > gridHeight * 2)
+            return;
+        if (!IsPortalStop(p, packed, gridWidth, gridHeight))
+            continue;
+
+        if (!IsPortalGapClear(start, p, packed))
+            return;
+
+        // Both ends of a gap between two walls find it
+        for (int i = 0; i < *portalCount; i++)
+        {
+            if ((portals[i].start.x == start.x && portals[i].start.y == start.y && portals[i].end.x == p.x && portals[i].end.y == p.y) ||
+                (portals[i].start.x == p.x && portals[i].start.y == p.y && portals[i].end.x == start.x && portals[i].end.y == start.y))
+                return;
+        }
+        if (*portalCount < portalCapacity)
+            portals[(*portalCount)++] = (PORTAL){start, p, -1, -1};
+        return;
+    }
+}
+
+// Cell (grid units) containing the half tile point p, -1 when off the board
+static inline int CellAt(GRIDPOINT p, short gridWidth, short gridHeight)
+{
+    int x = p.x >= 0 ? p.x / 2 : -1;
+    int y = p.y >= 0 ? p.y / 2 : -1;
+    if (x < 0 || y < 0 || x >= gridWidth || y >= gridHeight)
+        return -1;
+    return y * gridWidth + x;
+}
+
+// If the closed cell box touches wall ab (grid units)
+bool DoesWallTouchCell(GRIDPOINT a, GRIDPOINT b, short x, short y)
+{
+    if (PointRectCollision(a.x, a.y, x, y, x + 1, y + 1) ||
+        PointRectCollision(b.x, b.y, x, y, x + 1, y + 1))
+        return true;
+
+    GRIDPOINT corners[4] = {
+        (GRIDPOINT){x, y},
+        (GRIDPOINT){x + 1, y},
+        (GRIDPOINT){x + 1, y + 1},
+        (GRIDPOINT){x, y + 1}};
+    for (short i = 0; i < 4; i++)
+    {
+        if (SegmentsIntersect(a, b, corners[i], corners[(i + 1) % 4], false))
+            return true;
+    }
+    return false;
+}
+
+bool BuildRoomGraph(ROOMGRAPH *graph, const WALL *wallList, short gridWidth, short gridHeight)
+{
+    FreeRoomGraph(graph);
+    graph->gridWidth = gridWidth;
+    graph->gridHeight = gridHeight;
+    graph->wallWords = (maxWallCount + 31) / 32;
+
+    // Not static, floors get built on the prefetch thread too
+    WALLLIST *packedWalls = malloc(sizeof(WALLLIST));
+    if (!packedWalls)
+    {
+        FreeRoomGraph(graph);
+        return false;
+    }
+    const WALLLIST *packed = packedWalls;
+    PackWalls(wallList, packedWalls);
+
+    // Cell centres can land on a slanted wall or portal and cut the fill wrong, leave those maps unculled
+    for (short i = 0; i < packed->count; i++)
+    {
+        if (packed->start[i].x != packed->end[i].x && packed->start[i].y != packed->end[i].y)
+        {
+            free(packedWalls);
+            FreeRoomGraph(graph);
+            return false;
+        }
+    }
+
+    // Portals, at most one per wall end
+    int portalCapacity = packed->count * 2;
+    graph->portals = malloc(max(portalCapacity, 1) * sizeof(PORTAL));
+    int cellCount = gridWidth * gridHeight;
+    graph->cellRoom = malloc(cellCount * sizeof(int));
+    int *queue = malloc(cellCount * sizeof(int));
+    if (!graph->portals || !graph->cellRoom || !queue)
+    {
+        free(queue);
+        free(packedWalls);
+        FreeRoomGraph(graph);
+        return false;
+    }
+
+    for (short i = 0; i < packed->count; i++)
+    {
+        FindPortal(packed->start[i], packed->end[i], packed, gridWidth, gridHeight, graph->portals, &graph->portalCount, portalCapacity);
+        FindPortal(packed->end[i], packed->start[i], packed, gridWidth, gridHeight, graph->portals, &graph->portalCount, portalCapacity);
+    }
+
+    // Flood fill, neighbouring cells are in the same room unless a wall or portal is between their centres
+    for (int i = 0; i < cellCount; i++)
+    {
+        graph->cellRoom[i] = -1;
+    }
+    for (int seed = 0; seed < cellCount; seed++)
+    {
+        if (graph->cellRoom[seed] != -1)
+            continue;
+
+        int room = graph->roomCount++;
+        int queueStart = 0;
+        int queueEnd = 0;
+        graph->cellRoom[seed] = room;
+        queue[queueEnd++] = seed;
+
+        while (queueStart < queueEnd)
+        {
+            int cell = queue[queueStart++];
+            short x = cell % gridWidth;
+            short y = cell / gridWidth;
+            GRIDPOINT centre = (GRIDPOINT){x * 2 + 1, y * 2 + 1};
+
+            short neighbours[4][2] = {{x + 1, y}, {x - 1, y}, {x, y + 1}, {x, y - 1}};
+            for (short n = 0; n < 4; n++)
+            {
+                short nx = neighbours[n][0];
+                short ny = neighbours[n][1];
+                if (nx < 0 || ny < 0 || nx >= gridWidth || ny >= gridHeight)
+                    continue;
+                int next = ny * gridWidth + nx;
+                if (graph->cellRoom[next] != -1)
+                    continue;
+
+                GRIDPOINT nextCentre = (GRIDPOINT){nx * 2 + 1, ny * 2 + 1};
+                bool blocked = false;
+                for (short i = 0; i < packed->count && !blocked; i++)
+                {
+                    blocked = SegmentsIntersect(
+                        centre, nextCentre,
+                        (GRIDPOINT){packed->start[i].x * 2, packed->start[i].y * 2},
+                        (GRIDPOINT){packed->end[i].x * 2, packed->end[i].y * 2},
+                        false);
+                }
+                for (int i = 0; i < graph->portalCount && !blocked; i++)
+                {
+                    blocked = SegmentsIntersect(centre, nextCentre, graph->portals[i].start, graph->portals[i].end, false);
+                }
+                if (blocked)
+                    continue;
+
+                graph->cellRoom[next] = room;
+                queue[queueEnd++] = next;
+            }
+        }
+    }
+    free(queue);
+
+    // Rooms either side of each portal, one entry per pair of rooms it joins along its length,
+    // dropping the ones that don't join two rooms
+    int joinCapacity = max(graph->portalCount * maxPortalWidth, 1);
+    PORTAL *joins = malloc(joinCapacity * sizeof(PORTAL));
+    if (!joins)
+    {
+        free(packedWalls);
+        FreeRoomGraph(graph);
+        return false;
+    }
+    int joinCount = 0;
+    for (int i = 0; i < graph->portalCount; i++)
+    {
+        PORTAL portal = graph->portals[i];
+        GRIDPOINT direction = (GRIDPOINT){(portal.end.x > portal.start.x) - (portal.end.x < portal.start.x), (portal.end.y > portal.start.y) - (portal.end.y < portal.start.y)};
+        int halfSteps = max(abs(portal.end.x - portal.start.x), abs(portal.end.y - portal.start.y));
+
+        // Beside the middle of every tile the portal crosses
+        for (int k = 1; k < halfSteps; k += 2)
+        {
+            GRIDPOINT middle = (GRIDPOINT){portal.start.x + direction.x * k, portal.start.y + direction.y * k};
+            int cellA = CellAt((GRIDPOINT){middle.x - direction.y, middle.y + direction.x}, gridWidth, gridHeight);
+            int cellB = CellAt((GRIDPOINT){middle.x + direction.y, middle.y - direction.x}, gridWidth, gridHeight);
+            if (cellA == -1 || cellB == -1 || graph->cellRoom[cellA] == graph->cellRoom[cellB])
+                continue;
+
+            portal.roomA = graph->cellRoom[cellA];
+            portal.roomB = graph->cellRoom[cellB];
+            if (joinCount > 0 &&
+                memcmp(&joins[joinCount - 1], &portal, sizeof(PORTAL)) == 0)
+                continue;
+            if (joinCount < joinCapacity)
+                joins[joinCount++] = portal;
+        }
+    }
+    free(graph->portals);
+    graph->portals = joins;
+    graph->portalCount = joinCount;
+
+    // Portal lists per room
+    graph->roomPortalStart = calloc(graph->roomCount + 1, sizeof(int));
+    graph->roomPortals = malloc(max(graph->portalCount * 2, 1) * sizeof(int));
+    graph->roomWalls = calloc((size_t)graph->roomCount * graph->wallWords, sizeof(uint32_t));
+    graph->roomVisited = malloc(((graph->roomCount + 31) / 32) * sizeof(uint32_t));
+    graph->visitStackCapacity = max(graph->portalCount * 4, 64);
+    graph->visitStack = malloc(graph->visitStackCapacity * sizeof(ROOMVISIT));
+    graph->portalViews = malloc(max(graph->portalCount * 2, 1) * sizeof(ROOMVISIT));
+    if (!graph->roomPortalStart || !graph->roomPortals || !graph->roomWalls || !graph->roomVisited || !graph->visitStack || !graph->portalViews)
+    {
+        free(packedWalls);
+        FreeRoomGraph(graph);
+        return false;
+    }
+    for (int i = 0; i < graph->portalCount; i++)
+    {
+        graph->roomPortalStart[graph->portals[i].roomA + 1]++;
+        graph->roomPortalStart[graph->portals[i].roomB + 1]++;
+    }
+    for (int room = 0; room < graph->roomCount; room++)
+    {
+        graph->roomPortalStart[room + 1] += graph->roomPortalStart[room];
+    }
+    int *fill = calloc(graph->roomCount, sizeof(int));
+    if (!fill)
+    {
+        free(packedWalls);
+        FreeRoomGraph(graph);
+        return false;
+    }
+    for (int i = 0; i < graph->portalCount; i++)
+    {
+        int roomA = graph->portals[i].roomA;
+        int roomB = graph->portals[i].roomB;
+        graph->roomPortals[graph->roomPortalStart[roomA] + fill[roomA]++] = i;
+        graph->roomPortals[graph->roomPortalStart[roomB] + fill[roomB]++] = i;
+    }
+    free(fill);
+
+    // Walls of each room, every room with a cell the wall touches
+    for (short i = 0; i < packed->count; i++)
+    {
+        GRIDPOINT a = packed->start[i];
+        GRIDPOINT b = packed->end[i];
+        for (short y = max(min(a.y, b.y) - 1, 0); y <= min(max(a.y, b.y), gridHeight - 1); y++)
+        {
+            for (short x = max(min(a.x, b.x) - 1, 0); x <= min(max(a.x, b.x), gridWidth - 1); x++)
+            {
+                if (DoesWallTouchCell(a, b, x, y))
+                    BitsetSet(&graph->roomWalls[(size_t)graph->cellRoom[y * gridWidth + x] * graph->wallWords], packed->index[i]);
+            }
+        }
+    }
+
+    free(packedWalls);
+
+    graph->wallHash = HashWalls(wallList);
+    graph->valid = true;
+    return true;
+}
+
+static inline bool IsRoomGraphUsable(const ROOMGRAPH *graph, uint32_t wallHash, short gridWidth, short gridHeight)
+{
+    return graph->valid &&
+           graph->wallHash == wallHash &&
+           graph->gridWidth == gridWidth &&
+           graph->gridHeight == gridHeight;
+}
+
+// Walk the rooms visible from the eye through portals and OR their walls into visibleWalls
+// Returns false if the walk couldn't finish (then every wall has to be considered)
+bool CollectRoomWalls(ROOMGRAPH *graph, GRIDPOINT eye, uint32_t *visibleWalls)
+{
+    memset(visibleWalls, 0, graph->wallWords * sizeof(uint32_t));
+    memset(graph->roomVisited, 0, ((graph->roomCount + 31) / 32) * sizeof(uint32_t));
+    for (int i = 0; i < graph->portalCount * 2; i++)
+    {
+        graph->portalViews[i].room = -1;
+    }
+    int stackSize = 0;
+    // Plenty for real maps, a walk that gets this long gives up instead of blowing up
+    int visitBudget = graph->visitStackCapacity * 4;
+
+    // The eye can sit on a cell edge or corner, start in every room it touches
+    for (short oy = -1; oy <= 0; oy++)
+    {
+        for (short ox = -1; ox <= 0; ox++)
+        {
+            int cell = CellAt((GRIDPOINT){eye.x + ox, eye.y + oy}, graph->gridWidth, graph->gridHeight);
+            if (cell == -1)
+                continue;
+            // A room with no way out is most likely a fill that went wrong, don't trust it
+            int room = graph->cellRoom[cell];
+            if (graph->roomPortalStart[room] == graph->roomPortalStart[room + 1])
+                return false;
+            if (stackSize == graph->visitStackCapacity)
+                return false;
+            graph->visitStack[stackSize++] = (ROOMVISIT){room, -1, true, (GRIDPOINT){0, 0}, (GRIDPOINT){0, 0}, 0};
+        }
+    }
+    // Off the board, no room to start from
+    if (stackSize == 0)
+        return false;
+
+    while (stackSize > 0)
+    {
+        ROOMVISIT visit = graph->visitStack[--stackSize];
+        if (--visitBudget < 0)
+            return false;
+
+        if (!BitsetGet(graph->roomVisited, visit.room))
+        {
+            BitsetSet(graph->roomVisited, visit.room);
+            const uint32_t *roomWalls = &graph->roomWalls[(size_t)visit.room * graph->wallWords];
+            for (int i = 0; i < graph->wallWords; i++)
+            {
+                visibleWalls[i] |= roomWalls[i];
+            }
+        }
+        // A straight sight line goes through each portal at most once
+        if (visit.depth >= graph->portalCount)
+            continue;
+
+        // Sight lines that came in through a portal carry on away from the eye, past its line
+        const PORTAL *entry = visit.entryPortal != -1 ? &graph->portals[visit.entryPortal] : NULL;
+        int eyeSide = entry ? Orientation(entry->start, entry->end, eye) : 0;
+
+        for (int i = graph->roomPortalStart[visit.room]; i < graph->roomPortalStart[visit.room + 1]; i++)
+        {
+            int portalIndex = graph->roomPortals[i];
+            const PORTAL *portal = &graph->portals[portalIndex];
+            if (portalIndex == visit.entryPortal)
+                continue;
+            if (eyeSide != 0 &&
+                Orientation(entry->start, entry->end, portal->start) * eyeSide >= 0 &&
+                Orientation(entry->start, entry->end, portal->end) * eyeSide >= 0)
+                continue;
+            int nextRoom = portal->roomA == visit.room ? portal->roomB : portal->roomA;
+
+            ROOMVISIT next = (ROOMVISIT){nextRoom, portalIndex, false, portal->start, portal->end, visit.depth + 1};
+            int winding = Orientation(eye, portal->start, portal->end);
+            if (winding == 0)
+            {
+                // Standing in the doorway sees everything, looking along it sees nothing
+                if (!PointInSegmentBox(eye, portal->start, portal->end))
+                    continue;
+                next.fullView = true;
+            }
+            else if (winding < 0)
+            {
+                next.left = portal->end;
+                next.right = portal->start;
+            }
+
+            if (!next.fullView && !visit.fullView)
+            {
+                // Narrow to the overlap of both views (both are under 180 degrees)
+                if (Orientation(eye, next.left, visit.left) > 0)
+                    next.left = visit.left;
+                if (Orientation(eye, visit.right, next.right) > 0)
+                    next.right = visit.right;
+                if (Orientation(eye, next.left, next.right) <= 0)
+                    continue;
+            }
+            else if (next.fullView)
+            {
+                next.fullView = visit.fullView;
+                next.left = visit.left;
+                next.right = visit.right;
+            }
+
+            // Already walked through here with a view at least as wide, nothing new past it
+            ROOMVISIT *walked = &graph->portalViews[portalIndex * 2 + (nextRoom == portal->roomB)];
+            if (walked->room != -1 &&
+                (walked->fullView ||
+                 (!next.fullView &&
+                  Orientation(eye, walked->left, next.left) >= 0 &&
+                  Orientation(eye, next.right, walked->right) >= 0)))
+                continue;
+            *walked = next;
+
+            if (stackSize == graph->visitStackCapacity)
+                return false;
+            graph->visitStack[stackSize++] = next;
+        }
+    }
+    return true;
+}
+
+// Build the shadow quads for a snapshot (runs on the worker when threads are available)
+void ComputeVisibility(const VISIBILITYSNAPSHOT *snapshot, VISIBILITYRESULT *result)
+{
+    result->quadCount = 0;
+    if (!snapshot->hasToken)
+        return;
+
+    GRIDPOINT eye = (GRIDPOINT){
+        snapshot->token.x * 2 + snapshot->token.width,
+        snapshot->token.y * 2 + snapshot->token.height};
+    // Every shadow has to reach at least this far from the eye (half tile units)
+    double farthestCorner = hypot(
+        max(eye.x, snapshot->gridWidth * 2 - eye.x),
+        max(eye.y, snapshot->gridHeight * 2 - eye.y));
+
+    // Start from every wall, then narrow down with whatever culling data matches these walls
+    uint32_t visibleWalls[(512 + 31) / 32];
+    const int wallWords = (maxWallCount + 31) / 32;
+    memset(visibleWalls, 0xFF, sizeof(visibleWalls));
+
+    // Walls the PVS says can be seen from here
+    if (IsPvsUsable(&pvs, snapshot->wallHash, snapshot->gridWidth, snapshot->gridHeight))
+    {
+        int eyeIndex = PvsEyeIndex(&pvs, eye);
+        if (eyeIndex != -1)
+        {
+            for (int i = 0; i < wallWords; i++)
+            {
+                visibleWalls[i] &= pvs.wallBits[(size_t)eyeIndex * pvs.wallWords + i];
+            }
+        }
+    }
+
+    // Walls of the rooms that can be seen through portals
+    if (IsRoomGraphUsable(&roomGraph, snapshot->wallHash, snapshot->gridWidth, snapshot->gridHeight))
+    {
+        uint32_t roomWalls[(512 + 31) / 32];
+        if (CollectRoomWalls(&roomGraph, eye, roomWalls))
+        {
+            for (int i = 0; i < wallWords; i++)
+            {
+                visibleWalls[i] &= roomWalls[i];
+            }
+        }
+    }
+
+    // Hidden walls only cast shadows inside other shadows, so only the set bits are visited
+    for (int word = 0; word < wallWords; word++)
+    {
+        uint32_t bits = visibleWalls[word];
+        while (bits)
+        {
+            short i = word * 32 + __builtin_ctz(bits);
+            bits &= bits - 1;
+
+            if (!snapshot->walls[i].state)
+                continue;
+
+            GRIDPOINT a = HalfTilePoint(snapshot->walls[i].startX, snapshot->walls[i].startY);
+            GRIDPOINT b = HalfTilePoint(snapshot->walls[i].endX, snapshot->walls[i].endY);
+
+            int winding = Orientation(eye, a, b);
+            // Wall seen edge on (or the eye is on it), nothing is hidden behind it
+            if (winding == 0)
+                continue;
+
+            double extension = ShadowExtension(eye, a, b, farthestCorner);
+            Vector2 c = FoVEndpoint(eye, a, extension, snapshot->tileSize);
+            Vector2 d = FoVEndpoint(eye, b, extension, snapshot->tileSize);
+
+            SHADOWQUAD *quad = &result->quads[result->quadCount++];
+            quad->points[0] = HalfTileToPixels(a, snapshot->tileSize);
+            if (winding < 0)
+            {
+                // clockwise
+                quad->points[1] = c;
+                quad->points[2] = d;
+                quad->points[3] = HalfTileToPixels(b, snapshot->tileSize);
+            }
+            else
+            {
+                // counter-clockwise.
+                quad->points[1] = HalfTileToPixels(b, snapshot->tileSize);
+                quad->points[2] = d;
+                quad->points[3] = c;
+            }
+        }
+    }
+}
+
+// Compute into the back buffer and make it the front one
+void PublishVisibility(const VISIBILITYSNAPSHOT *snapshot)
+{
+    int back = 1 - atomic_load(&visibilityFrontIndex);
+    ComputeVisibility(snapshot, &visibilityResults[back]);
+    atomic_store(&visibilityFrontIndex, back);
+}
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+void *VisibilityWorker(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        sem_wait(&visibilityJobSemaphore);
+        PublishVisibility(&visibilitySnapshot);
+        atomic_store(&visibilityWorkerBusy, false);
+    }
+    return NULL;
+}
+#endif
+
+void StartVisibilityWorker()
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+    if (sem_init(&visibilityJobSemaphore, 0, 0) == 0 &&
+        pthread_create(&visibilityThread, NULL, VisibilityWorker, NULL) == 0)
+    {
+        visibilityAsync = true;
+    }
+#endif
+}
+
+// Wait until the worker no longer reads the snapshot (only used when the map is about to change under it)
+void WaitForVisibilityWorker()
+{
+    while (atomic_load(&visibilityWorkerBusy))
+    {
+    }
+}
+
+// Start building the PVS if it doesn't match the current walls
+// Culling carries on without it (rooms only) until UpdatePotentiallyVisibleSetBuild swaps it in,
+// or with a worker until QueueFloorPrefetch has had it built there
+void RefreshPotentiallyVisibleSet()
+{
+    uint32_t wallHash = HashWalls(walls);
+    if (IsPvsUsable(&pvs, wallHash, gameBoardGridWidth, gameBoardGridHeight))
+    {
+        CancelPotentiallyVisibleSetBuild(&pvsBuild);
+        return;
+    }
+    // Already on it
+    if (pvsBuild.active &&
+        pvsBuild.wallHash == wallHash &&
+        pvsBuild.set.gridWidth == gameBoardGridWidth &&
+        pvsBuild.set.gridHeight == gameBoardGridHeight)
+        return;
+
+    // A saved one made for these walls, floors prefetched without a worker get theirs here
+    PVS saved = (PVS){0};
+    if (LoadPotentiallyVisibleSet(&saved, mapPvsPath) &&
+        IsPvsUsable(&saved, wallHash, gameBoardGridWidth, gameBoardGridHeight))
+    {
+        CancelPotentiallyVisibleSetBuild(&pvsBuild);
+        // The worker reads the PVS while it runs
+        WaitForVisibilityWorker();
+        FreePotentiallyVisibleSet(&pvs);
+        pvs = saved;
+        return;
+    }
+    FreePotentiallyVisibleSet(&saved);
+
+    if (pvsBuildOnWorker)
+    {
+        CancelPotentiallyVisibleSetBuild(&pvsBuild);
+        return;
+    }
+    StartPotentiallyVisibleSetBuild(&pvsBuild, walls, gameBoardGridWidth, gameBoardGridHeight);
+}
+
+// Once a frame: another slice of the PVS build, swapped in when it's done
+void UpdatePotentiallyVisibleSetBuild(double timeLimit)
+{
+    if (!pvsBuild.active)
+        return;
+
+    uint32_t wallHash = HashWalls(walls);
+    // Got one from somewhere else in the meantime (a floor prefetch)
+    if (IsPvsUsable(&pvs, wallHash, gameBoardGridWidth, gameBoardGridHeight))
+    {
+        CancelPotentiallyVisibleSetBuild(&pvsBuild);
+        return;
+    }
+    if (!StepPotentiallyVisibleSetBuild(&pvsBuild, timeLimit))
+        return;
+
+    // The walls or the board changed while it was being built
+    if (!IsPvsUsable(&pvsBuild.set, wallHash, gameBoardGridWidth, gameBoardGridHeight))
+    {
+        CancelPotentiallyVisibleSetBuild(&pvsBuild);
+        return;
+    }
+
+    // The worker reads the PVS while it runs
+    WaitForVisibilityWorker();
+    FreePotentiallyVisibleSet(&pvs);
+    pvs = pvsBuild.set;
+    pvsBuild.set = (PVS){0};
+}
+
+// Make sure all the visibility culling data matches the current walls
+void RefreshVisibilityData()
+{
+    RefreshPotentiallyVisibleSet();
+
+    if (IsRoomGraphUsable(&roomGraph, HashWalls(walls), gameBoardGridWidth, gameBoardGridHeight))
+        return;
+
+    // The worker walks the room graph while it runs
+    WaitForVisibilityWorker();
+    BuildRoomGraph(&roomGraph, walls, gameBoardGridWidth, gameBoardGridHeight);
+}
+
+// Snapshot the wall/token state and hand it to the worker if anything changed
+void UpdateVisibility()
+{
+    // Previous job still running, keep drawing the last published result
+    if (atomic_load(&visibilityWorkerBusy))
+        return;
+
+    // memset so padding bytes compare equal
+    memset(&visibilityScratch, 0, sizeof(visibilityScratch));
+    for (short i = 0; i < maxWallCount; i++)
+    {
+        if (walls[i].state)
+        {
+            visibilityScratch.walls[i] = walls[i];
+            // Selection marks don't change what is visible
+            visibilityScratch.walls[i].state = WALL_PLACED;
+        }
+    }
+    visibilityScratch.hasToken = drawFov && activeToken != -1;
+    if (visibilityScratch.hasToken)
+    {
+        visibilityScratch.token.x = tokens[activeToken].x;
+        visibilityScratch.token.y = tokens[activeToken].y;
+        visibilityScratch.token.width = tokens[activeToken].width;
+        visibilityScratch.token.height = tokens[activeToken].height;
+    }
+    visibilityScratch.gridWidth = gameBoardGridWidth;
+    visibilityScratch.gridHeight = gameBoardGridHeight;
+    visibilityScratch.tileSize = tileSize;
+    visibilityScratch.wallHash = HashWalls(visibilityScratch.walls);
+
+    if (visibilitySnapshotValid &&
+        memcmp(&visibilityScratch, &visibilitySnapshot, sizeof(visibilityScratch)) == 0)
+        return;
+
+    visibilitySnapshot = visibilityScratch;
+    visibilitySnapshotValid = true;
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+    if (visibilityAsync)
+    {
+        atomic_store(&visibilityWorkerBusy, true);
+        sem_post(&visibilityJobSemaphore);
+        return;
+    }
+#endif
+    PublishVisibility(&visibilitySnapshot);
+}
+
+// Wall detection
+// Finds dark ink along the tile grid lines of the map image and turns it into walls.
+// Only grid aligned walls are found (that's all MAP_PLACEWALLS can snap to anyway),
+// diagonal ones still have to be placed by hand
+
+// Brightest a pixel may be (0-255 luma) to count as wall ink
+unsigned char wallDetectDarkness = 80;
+// Fraction of a tile edge that has to be ink for it to become a wall
+float wallDetectCoverage = 0.7f;
+
+// Darkest luma across the rows [top, bottom] for every column, into lineLuma
+// Plain byte loops over whole rows so the compiler can vectorise them
+void DarkestRowsLuma(const unsigned char *rgba, int width, int top, int bottom, unsigned char *lineLuma)
+{
+    memset(lineLuma, 255, width);
+    for (int y = top; y <= bottom; y++)
+    {
+        const unsigned char *row = &rgba[(size_t)y * width * 4];
+        for (int x = 0; x < width; x++)
+        {
+            unsigned char luma = (row[x * 4] * 77 + row[x * 4 + 1] * 150 + row[x * 4 + 2] * 29) >> 8;
+            lineLuma[x] = luma < lineLuma[x] ? luma : lineLuma[x];
+        }
+    }
+}
+
+// If enough of lineLuma[from, to) is ink
+bool IsInkedSpan(const unsigned char *lineLuma, int from, int to)
+{
+    if (to <= from)
+        return false;
+
+    int ink = 0;
+    for (int i = from; i < to; i++)
+    {
+        ink += lineLuma[i] <= wallDetectDarkness;
+    }
+    return ink >= (to - from) * wallDetectCoverage;
+}
+
+// Put a detected wall in the first free slot, skipping ones that are already there
+bool AddDetectedWall(short startX, short startY, short endX, short endY)
+{
+    short freeIndex = -1;
+    for (short i = 0; i < maxWallCount; i++)
+    {
+        if (!walls[i].state)
+        {
+            if (freeIndex == -1)
+                freeIndex = i;
+            continue;
+        }
+        if ((walls[i].startX == startX && walls[i].startY == startY && walls[i].endX == endX && walls[i].endY == endY) ||
+            (walls[i].startX == endX && walls[i].startY == endY && walls[i].endX == startX && walls[i].endY == startY))
+            return false;
+    }
+    if (freeIndex == -1)
+        return false;
+
+    walls[freeIndex] = (WALL){WALL_PLACED, startX, startY, endX, endY};
+    return true;
+}
+
+// Scan every grid line of the image and merge inked tile edges into as few walls as possible
+// Returns how many walls were added
+int DetectWalls(Image *image)
+{
+    if (image->format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8)
+        ImageFormat(image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    const unsigned char *rgba = image->data;
+    int width = image->width;
+    int height = image->height;
+
+    // Image pixels per tile and how far either side of a grid line ink may sit
+    float tilePixels = tileSize / mapTextureScale;
+    int band = max((int)(tilePixels / 10), 1);
+
+    unsigned char *lineLuma = malloc(max(width, height));
+    if (!lineLuma)
+        return 0;
+
+    int added = 0;
+
+    // Horizontal grid lines, one band of rows each
+    for (short j = 0; j <= gameBoardGridHeight; j++)
+    {
+        int lineY = (int)roundf(j * tilePixels);
+        if (lineY - band >= height)
+            break;
+        DarkestRowsLuma(rgba, width, max(lineY - band, 0), min(lineY + band, height - 1), lineLuma);
+
+        short runStart = -1;
+        for (short i = 0; i <= gameBoardGridWidth; i++)
+        {
+            // Leave out the ends of the edge, perpendicular walls put ink there
+            int from = (int)roundf(i * tilePixels) + band;
+            int to = min((int)roundf((i + 1) * tilePixels) - band, width);
+            bool inked = i < gameBoardGridWidth && IsInkedSpan(lineLuma, from, to);
+
+            if (inked && runStart == -1)
+                runStart = i;
+            if (!inked && runStart != -1)
+            {
+                added += AddDetectedWall(runStart, j, i, j);
+                runStart = -1;
+            }
+        }
+    }
+
+    // Vertical grid lines, built a row at a time so the image is still read in order
+    short lineCount = gameBoardGridWidth + 1;
+    unsigned char *columnLuma = malloc((size_t)lineCount * height);
+    if (!columnLuma)
+    {
+        free(lineLuma);
+        return added;
+    }
+    memset(columnLuma, 255, (size_t)lineCount * height);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *row = &rgba[(size_t)y * width * 4];
+        for (short i = 0; i < lineCount; i++)
+        {
+            int lineX = (int)roundf(i * tilePixels);
+            unsigned char darkest = 255;
+            for (int x = max(lineX - band, 0); x <= min(lineX + band, width - 1); x++)
+            {
+                unsigned char luma = (row[x * 4] * 77 + row[x * 4 + 1] * 150 + row[x * 4 + 2] * 29) >> 8;
+                darkest = luma < darkest ? luma : darkest;
+            }
+            columnLuma[(size_t)i * height + y] = darkest;
+        }
+    }
+    for (short i = 0; i < lineCount; i++)
+    {
+        const unsigned char *line = &columnLuma[(size_t)i * height];
+
+        short runStart = -1;
+        for (short j = 0; j <= gameBoardGridHeight; j++)
+        {
+            int from = (int)roundf(j * tilePixels) + band;
+            int to = min((int)roundf((j + 1) * tilePixels) - band, height);
+            bool inked = j < gameBoardGridHeight && IsInkedSpan(line, from, to);
+
+            if (inked && runStart == -1)
+                runStart = j;
+            if (!inked && runStart != -1)
+            {
+                added += AddDetectedWall(i, runStart, i, j);
+                runStart = -1;
+            }
+        }
+    }
+
+    free(columnLuma);
+    free(lineLuma);
+    return added;
+}
+
+// Floors
+// A session can hold several maps (floors), each with its own walls, tokens, grid and image.
+// The current floor lives in the usual globals (walls, tokens, pvs, ...) and is copied back
+// into its FLOORLAYOUT when another floor takes over.
+// Textures and PVS/room data of the other floors are kept in an LRU cache with a memory budget,
+// and the floors next to the current one are decoded/built in the background so switching is instant
+typedef struct FloorLayout
+{
+    char imagePath[256];
+    char pvsPath[256];
+    short gridWidth;
+    short gridHeight;
+    WALL walls[512];
+    TOKEN tokens[512];
+    short activeToken;
+} FLOORLAYOUT;
+
+typedef struct FloorCache
+{
+    bool textureLoaded;
+    Texture2D texture;
+    // Only valid while the floor isn't the current one, the current floor's are in pvs and roomGraph
+    PVS pvs;
+    ROOMGRAPH roomGraph;
+    // LRU stamp
+    unsigned int lastUsed;
+    // Filled in by a prefetch and not shown since
+    bool prefetched;
+} FLOORCACHE;
+
+#define MAX_FLOOR_COUNT 8
+const short maxFloorCount = MAX_FLOOR_COUNT;
+FLOORLAYOUT floorLayouts[MAX_FLOOR_COUNT];
+FLOORCACHE floorCaches[MAX_FLOOR_COUNT];
+short floorCount = 0;
+short currentFloor = 0;
+
+// Cache budget for everything that isn't the current floor's (textures counted as RGBA)
+size_t floorCacheBudget = 256 * 1024 * 1024;
+unsigned int floorCacheClock = 0;
+// Set when a prefetch would only push out another prefetch, cleared on the next floor switch
+bool floorPrefetchPaused = false;
+
+// What the last prefetch of a floor couldn't make (a missing image, walls the rooms can't be built for),
+// not tried again until the floor's image or walls change. Kept apart from the cache so evicting doesn't forget it
+typedef struct FloorPrefetchFailure
+{
+    char imagePath[256];
+    bool geometry;
+    uint32_t wallHash;
+} FLOORPREFETCHFAILURE;
+
+FLOORPREFETCHFAILURE floorPrefetchFailures[MAX_FLOOR_COUNT];
+
+typedef enum PREFETCHSTATE
+{
+    PREFETCH_IDLE,
+    PREFETCH_RUNNING,
+    PREFETCH_DONE
+} PREFETCHSTATE;
+
+// One background floor load, the main thread fills in the inputs and adopts the outputs
+typedef struct FloorPrefetch
+{
+    short floor;
+    char imagePath[256];
+    char pvsPath[256];
+    short gridWidth;
+    short gridHeight;
+    WALL walls[512];
+    bool needsTexture;
+    bool needsGeometry;
+    // Build a PVS if the saved one didn't fit
+    bool buildPvs;
+    // Left out for the current floor, its rooms are built when the walls are done
+    bool buildRoomGraph;
+    // Files are read on the main thread, with -pthread a worker's file access waits on the main thread
+    unsigned char *imageData;
+    int imageDataSize;
+    char imageType[16];
+    Image image;
+    PVS pvs;
+    ROOMGRAPH roomGraph;
+} FLOORPREFETCH;
+
+FLOORPREFETCH floorPrefetch;
+atomic_int floorPrefetchState = PREFETCH_IDLE;
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+pthread_t floorPrefetchThread;
+sem_t floorPrefetchSemaphore;
+bool floorPrefetchAsync = false;
+#endif
+
+// Without a worker the PVS is left to the main thread, a slice per frame once the floor is shown
+static inline bool CanPrefetchPvs()
+{
+    return pvsBuildOnWorker;
+}
+
+// Add a floor (empty walls and tokens), returns its index or -1 when full
+short AddFloor(const char *imagePath, short gridWidth, short gridHeight)
+{
+    if (floorCount == maxFloorCount || gridWidth <= 0 || gridHeight <= 0)
+        return -1;
+
+    FLOORLAYOUT *layout = &floorLayouts[floorCount];
+    memset(layout, 0, sizeof(FLOORLAYOUT));
+    snprintf(layout->imagePath, sizeof(layout->imagePath), "%s", imagePath);
+    // PVS file sits next to the image
+    snprintf(layout->pvsPath, sizeof(layout->pvsPath), "%s", imagePath);
+    char *extension = strrchr(layout->pvsPath, '.');
+    if (extension && !strchr(extension, '/'))
+        *extension = '\0';
+    snprintf(layout->pvsPath + strlen(layout->pvsPath), sizeof(layout->pvsPath) - strlen(layout->pvsPath), ".pvs");
+    layout->gridWidth = gridWidth;
+    layout->gridHeight = gridHeight;
+    layout->activeToken = -1;
+
+    floorCaches[floorCount] = (FLOORCACHE){0};
+    floorPrefetchFailures[floorCount] = (FLOORPREFETCHFAILURE){0};
+    return floorCount++;
+}
+
+// Walls of a floor, wherever they currently live
+const WALL *FloorWalls(short floor)
+{
+    return floor == currentFloor ? walls : floorLayouts[floor].walls;
+}
+
+size_t PvsBytes(const PVS *set)
+{
+    return set->valid ? (size_t)set->eyeCount * set->wallWords * sizeof(uint32_t) : 0;
+}
+
+size_t RoomGraphBytes(const ROOMGRAPH *graph)
+{
+    if (!graph->valid)
+        return 0;
+    return (size_t)graph->gridWidth * graph->gridHeight * sizeof(int) +
+           (size_t)graph->portalCount * (sizeof(PORTAL) + 2 * sizeof(int)) +
+           (size_t)graph->roomCount * (graph->wallWords * sizeof(uint32_t) + sizeof(int)) +
+           (size_t)graph->visitStackCapacity * sizeof(ROOMVISIT) +
+           (size_t)graph->portalCount * 2 * sizeof(ROOMVISIT);
+}
+
+size_t FloorCacheBytes(short floor)
+{
+    const FLOORCACHE *cache = &floorCaches[floor];
+    return (cache->textureLoaded ? (size_t)cache->texture.width * cache->texture.height * 4 : 0) +
+           PvsBytes(&cache->pvs) +
+           RoomGraphBytes(&cache->roomGraph);
+}
+
+void EvictFloor(short floor)
+{
+    FLOORCACHE *cache = &floorCaches[floor];
+    if (cache->textureLoaded)
+        UnloadTexture(cache->texture);
+    FreePotentiallyVisibleSet(&cache->pvs);
+    FreeRoomGraph(&cache->roomGraph);
+    *cache = (FLOORCACHE){0};
+}
+
+// Evict least recently used floors (never the current one) until the cache fits the budget
+void EnforceFloorCacheBudget()
+{
+    while (true)
+    {
+        size_t total = 0;
+        short oldest = -1;
+        for (short i = 0; i < floorCount; i++)
+        {
+            if (i == currentFloor)
+                continue;
+            size_t bytes = FloorCacheBytes(i);
+            total += bytes;
+            if (bytes && (oldest == -1 || floorCaches[i].lastUsed < floorCaches[oldest].lastUsed))
+                oldest = i;
+        }
+        if (total <= floorCacheBudget || oldest == -1)
+            return;
+
+        // Prefetches pushing out each other would just go round in circles
+        if (floorCaches[oldest].prefetched)
+            floorPrefetchPaused = true;
+        EvictFloor(oldest);
+    }
+}
+
+// Background half of a prefetch: decode the image, build the PVS if there was no saved one, build the rooms
+void RunFloorPrefetch(FLOORPREFETCH *job)
+{
+    if (job->imageData)
+    {
+        job->image = LoadImageFromMemory(job->imageType, job->imageData, job->imageDataSize);
+        UnloadFileData(job->imageData);
+        job->imageData = NULL;
+    }
+
+    if (job->needsGeometry)
+    {
+        if (job->buildPvs && !IsPvsUsable(&job->pvs, HashWalls(job->walls), job->gridWidth, job->gridHeight))
+            BuildPotentiallyVisibleSet(&job->pvs, job->walls, job->gridWidth, job->gridHeight);
+        if (job->buildRoomGraph)
+            BuildRoomGraph(&job->roomGraph, job->walls, job->gridWidth, job->gridHeight);
+    }
+}
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+void *FloorPrefetchWorker(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        sem_wait(&floorPrefetchSemaphore);
+        RunFloorPrefetch(&floorPrefetch);
+        atomic_store(&floorPrefetchState, PREFETCH_DONE);
+    }
+    return NULL;
+}
+#endif
+
+void StartFloorPrefetchWorker()
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+    if (sem_init(&floorPrefetchSemaphore, 0, 0) == 0 &&
+        pthread_create(&floorPrefetchThread, NULL, FloorPrefetchWorker, NULL) == 0)
+    {
+        floorPrefetchAsync = true;
+        pvsBuildOnWorker = true;
+    }
+#endif
+}
+
+// Main thread half of a prefetch: upload the texture and take over the geometry if it still fits the floor
+void AdoptFloorPrefetch()
+{
+    FLOORPREFETCH *job = &floorPrefetch;
+    short floor = job->floor;
+
+    // Floors can be replaced under a running prefetch (a replay starting)
+    if (floor < floorCount)
+    {
+        FLOORCACHE *cache = &floorCaches[floor];
+        bool isCurrent = floor == currentFloor;
+
+        bool adopted = false;
+
+        if (job->image.data && !cache->textureLoaded && !headless &&
+            strcmp(job->imagePath, floorLayouts[floor].imagePath) == 0)
+        {
+            cache->texture = LoadTextureFromImage(job->image);
+            cache->textureLoaded = cache->texture.id != 0;
+            adopted = cache->textureLoaded;
+        }
+
+        // Whatever it was asked for and couldn't make, against the image and walls it was asked for
+        // (not what got adopted, the walls can change under a build of the current floor)
+        FLOORPREFETCHFAILURE *failure = &floorPrefetchFailures[floor];
+        uint32_t jobWallHash = HashWalls(job->walls);
+        if (job->needsTexture && !job->image.data)
+            memcpy(failure->imagePath, job->imagePath, sizeof(failure->imagePath));
+        if (job->needsGeometry &&
+            ((job->buildPvs && !IsPvsUsable(&job->pvs, jobWallHash, job->gridWidth, job->gridHeight)) ||
+             (job->buildRoomGraph && !IsRoomGraphUsable(&job->roomGraph, jobWallHash, job->gridWidth, job->gridHeight))))
+        {
+            failure->geometry = true;
+            failure->wallHash = jobWallHash;
+        }
+
+        uint32_t wallHash = HashWalls(FloorWalls(floor));
+        short gridWidth = isCurrent ? gameBoardGridWidth : floorLayouts[floor].gridWidth;
+        short gridHeight = isCurrent ? gameBoardGridHeight : floorLayouts[floor].gridHeight;
+        PVS *targetPvs = isCurrent ? &pvs : &cache->pvs;
+        ROOMGRAPH *targetGraph = isCurrent ? &roomGraph : &cache->roomGraph;
+        if (isCurrent)
+        {
+            // The worker reads the current floor's geometry
+            WaitForVisibilityWorker();
+        }
+        if (!IsPvsUsable(targetPvs, wallHash, gridWidth, gridHeight) &&
+            IsPvsUsable(&job->pvs, wallHash, gridWidth, gridHeight))
+        {
+            FreePotentiallyVisibleSet(targetPvs);
+            *targetPvs = job->pvs;
+            job->pvs = (PVS){0};
+            adopted = true;
+        }
+        if (!IsRoomGraphUsable(targetGraph, wallHash, gridWidth, gridHeight) &&
+            IsRoomGraphUsable(&job->roomGraph, wallHash, gridWidth, gridHeight))
+        {
+            FreeRoomGraph(targetGraph);
+            *targetGraph = job->roomGraph;
+            job->roomGraph = (ROOMGRAPH){0};
+            adopted = true;
+        }
+
+        if (!isCurrent && adopted)
+        {
+            cache->lastUsed = ++floorCacheClock;
+            cache->prefetched = true;
+        }
+    }
+
+    if (job->image.data)
+        UnloadImage(job->image);
+    FreePotentiallyVisibleSet(&job->pvs);
+    FreeRoomGraph(&job->roomGraph);
+    job->image = (Image){0};
+
+    atomic_store(&floorPrefetchState, PREFETCH_IDLE);
+    EnforceFloorCacheBudget();
+}
+
+// Hand a filled in job to the worker, or run it here without one
+void StartFloorPrefetch(FLOORPREFETCH *job)
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+    if (floorPrefetchAsync)
+    {
+        atomic_store(&floorPrefetchState, PREFETCH_RUNNING);
+        sem_post(&floorPrefetchSemaphore);
+        return;
+    }
+#endif
+    // No threads, do it here (one floor per frame)
+    RunFloorPrefetch(job);
+    atomic_store(&floorPrefetchState, PREFETCH_DONE);
+}
+
+// Queue the current floor's PVS build, or else the next floor next to the current one that isn't ready yet
+void QueueFloorPrefetch()
+{
+    FLOORPREFETCH *job = &floorPrefetch;
+
+    // Culling is waiting on this one, a saved PVS has already been tried by RefreshPotentiallyVisibleSet
+    uint32_t currentWallHash = HashWalls(walls);
+    const FLOORPREFETCHFAILURE *currentFailure = &floorPrefetchFailures[currentFloor];
+    if (pvsBuildOnWorker && mapEditorMode == MAP_PLAY && currentFloor < floorCount &&
+        !IsPvsUsable(&pvs, currentWallHash, gameBoardGridWidth, gameBoardGridHeight) &&
+        !(currentFailure->geometry && currentFailure->wallHash == currentWallHash))
+    {
+        job->floor = currentFloor;
+        job->gridWidth = gameBoardGridWidth;
+        job->gridHeight = gameBoardGridHeight;
+        memcpy(job->walls, walls, sizeof(job->walls));
+        job->needsTexture = false;
+        job->needsGeometry = true;
+        job->buildPvs = true;
+        job->buildRoomGraph = false;
+        job->imageData = NULL;
+        job->image = (Image){0};
+        job->pvs = (PVS){0};
+        job->roomGraph = (ROOMGRAPH){0};
+        StartFloorPrefetch(job);
+        return;
+    }
+
+    if (floorPrefetchPaused)
+        return;
+
+    short neighbours[2] = {currentFloor + 1, currentFloor - 1};
+    for (short n = 0; n < 2; n++)
+    {
+        short floor = neighbours[n];
+        if (floor < 0 || floor >= floorCount)
+            continue;
+
+        FLOORCACHE *cache = &floorCaches[floor];
+        const FLOORLAYOUT *layout = &floorLayouts[floor];
+        const FLOORPREFETCHFAILURE *failure = &floorPrefetchFailures[floor];
+        uint32_t wallHash = HashWalls(layout->walls);
+        bool needsTexture =
+            !cache->textureLoaded && !headless &&
+            strcmp(failure->imagePath, layout->imagePath) != 0;
+        bool needsGeometry =
+            ((CanPrefetchPvs() && !IsPvsUsable(&cache->pvs, wallHash, layout->gridWidth, layout->gridHeight)) ||
+             !IsRoomGraphUsable(&cache->roomGraph, wallHash, layout->gridWidth, layout->gridHeight)) &&
+            !(failure->geometry && failure->wallHash == wallHash);
+        if (!needsTexture && !needsGeometry)
+            continue;
+
+        job->floor = floor;
+        memcpy(job->imagePath, layout->imagePath, sizeof(job->imagePath));
+        memcpy(job->pvsPath, layout->pvsPath, sizeof(job->pvsPath));
+        job->gridWidth = layout->gridWidth;
+        job->gridHeight = layout->gridHeight;
+        memcpy(job->walls, layout->walls, sizeof(job->walls));
+        job->needsTexture = needsTexture;
+        job->needsGeometry = needsGeometry;
+        job->buildPvs = CanPrefetchPvs();
+        job->buildRoomGraph = true;
+        job->image = (Image){0};
+        job->pvs = (PVS){0};
+        job->roomGraph = (ROOMGRAPH){0};
+
+        // Everything that comes from a file is read here, the worker only decodes and builds
+        job->imageData = NULL;
+        if (needsTexture)
+        {
+            job->imageData = LoadFileData(job->imagePath, &job->imageDataSize);
+            snprintf(job->imageType, sizeof(job->imageType), "%s", GetFileExtension(job->imagePath));
+        }
+        if (needsGeometry && job->buildPvs &&
+            (!LoadPotentiallyVisibleSet(&job->pvs, job->pvsPath) ||
+             !IsPvsUsable(&job->pvs, wallHash, job->gridWidth, job->gridHeight)))
+        {
+            FreePotentiallyVisibleSet(&job->pvs);
+        }
+
+        StartFloorPrefetch(job);
+        return;
+    }
+}
+
+// Once a frame: pick up finished prefetches and start the next one
+void UpdateFloorCache()
+{
+    if (atomic_load(&floorPrefetchState) == PREFETCH_DONE)
+        AdoptFloorPrefetch();
+    if (atomic_load(&floorPrefetchState) == PREFETCH_IDLE)
+        QueueFloorPrefetch();
+}
+
+// Point the map globals at the current floor's image and size the window/grid for it
+void ShowCurrentFloor()
+{
+    FLOORLAYOUT *layout = &floorLayouts[currentFloor];
+    FLOORCACHE *cache = &floorCaches[currentFloor];
+
+    mapImagePath = layout->imagePath;
+    mapPvsPath = layout->pvsPath;
+
+    if (headless)
+    {
+        // Nothing to upload to, the image is only needed for its size
+        Image image = LoadImage(mapImagePath);
+        mapTexture = (Texture2D){0, image.width, image.height, 1, image.format};
+        UnloadImage(image);
+    }
+    else
+    {
+        // Cache miss, nothing else for it but to load it now
+        if (!cache->textureLoaded)
+        {
+            cache->texture = LoadTexture(mapImagePath);
+            cache->textureLoaded = cache->texture.id != 0;
+        }
+        mapTexture = cache->texture;
+    }
+    cache->lastUsed = ++floorCacheClock;
+    cache->prefetched = false;
+
+    if (mapTexture.width > 0 && mapTexture.height > 0)
+    {
+        screenWidth = mapTexture.width * mapTextureScale;
+        screenHeight = mapTexture.height * mapTextureScale;
+        if (!headless)
+            SetWindowSize(screenWidth, screenHeight);
+    }
+
+    tileSize =
+        (screenWidth / gameBoardGridWidth) * (screenWidth <= screenHeight) +
+        (screenHeight / gameBoardGridHeight) * (screenWidth > screenHeight);
+}
+
+// Swap the current floor out and another one in
+bool SwitchFloor(short floor)
+{
+    if (floor < 0 || floor >= floorCount || floor == currentFloor)
+        return false;
+
+    // The worker reads the globals that are about to be swapped
+    // (a running prefetch only reads its own copy of a floor, it's adopted whenever it finishes)
+    WaitForVisibilityWorker();
+    // The PVS being built belongs to the old floor
+    CancelPotentiallyVisibleSetBuild(&pvsBuild);
+
+    // A half placed wall belongs to the old floor, cancel it before the walls are stored
+    if (wallPlacementStarted)
+    {
+        walls[placeWallIndex].state = WALL_NONE;
+        wallPlacementStarted = false;
+    }
+
+    // Current floor back into its layout and cache
+    FLOORLAYOUT *layout = &floorLayouts[currentFloor];
+    FLOORCACHE *cache = &floorCaches[currentFloor];
+    memcpy(layout->walls, walls, sizeof(walls));
+    memcpy(layout->tokens, tokens, sizeof(tokens));
+    layout->activeToken = activeToken;
+    layout->gridWidth = gameBoardGridWidth;
+    layout->gridHeight = gameBoardGridHeight;
+    cache->pvs = pvs;
+    cache->roomGraph = roomGraph;
+    // Just used, and the likeliest floor to go back to
+    cache->lastUsed = ++floorCacheClock;
+    pvs = (PVS){0};
+    roomGraph = (ROOMGRAPH){0};
+
+    // New floor out of its layout and cache
+    currentFloor = floor;
+    layout = &floorLayouts[currentFloor];
+    cache = &floorCaches[currentFloor];
+    memcpy(walls, layout->walls, sizeof(walls));
+    memcpy(tokens, layout->tokens, sizeof(tokens));
+    activeToken = layout->activeToken;
+    gameBoardGridWidth = layout->gridWidth;
+    gameBoardGridHeight = layout->gridHeight;
+    pvs = cache->pvs;
+    roomGraph = cache->roomGraph;
+    cache->pvs = (PVS){0};
+    cache->roomGraph = (ROOMGRAPH){0};
+
+    // Selections belonged to the old floor
+    boxSelectionStarted = false;
+    selectedWallIndex = -1;
+    for (short i = 0; i < maxWallCount; i++)
+    {
+        if (walls[i].state == WALL_MARKED)
+            walls[i].state = WALL_PLACED;
+    }
+
+    ShowCurrentFloor();
+    if (mapEditorMode == MAP_PLAY)
+        RefreshVisibilityData();
+
+    floorPrefetchPaused = false;
+    EnforceFloorCacheBudget();
+    return true;
+}
+
+// Drop every cached texture (the cache may not match the floors once a replay restores them)
+// ShowCurrentFloor has to be called before the next frame is drawn
+void FlushFloorCaches()
+{
+    for (short i = 0; i < maxFloorCount; i++)
+    {
+        EvictFloor(i);
+    }
+    floorPrefetchPaused = false;
+}
+
+bool ToggleWallColor()
+{
+    wallColorToggle = !wallColorToggle;
+    return wallColorToggle;
+}
+
+bool ToggleMapMode()
+{
+    if (mapEditorMode == MAP_PLACEWALLS)
+    {
+        mapEditorMode = MAP_PLAY;
+        boxSelectionStarted = false;
+        // Walls are done, make sure the PVS and rooms match them
+        RefreshVisibilityData();
+        return true;
+    }
+    else
+    {
+        mapEditorMode = MAP_PLACEWALLS;
+        boxSelectionStarted = false;
+        return false;
+    }
+}
+
+int DetectWallsFromMap()
+{
+    Image image = LoadImage(mapImagePath);
+    if (!image.data)
+        return 0;
+
+    int added = DetectWalls(&image);
+    UnloadImage(image);
+    return added;
+}
+
+// Input
+// Everything UpdateDrawFrame reads from the mouse, keyboard and page buttons for one frame.
+// Live input is polled into frameInput, recordings store the frames, replays feed them back,
+// so a recorded session plays out exactly the same in the browser and in the native build
+typedef enum INPUTBIT
+{
+    INPUT_LEFT_PRESSED = 1,
+    INPUT_RIGHT_PRESSED = 1 << 1,
+    INPUT_RIGHT_DOWN = 1 << 2,
+    INPUT_RIGHT_RELEASED = 1 << 3,
+    INPUT_KEY_UP = 1 << 4,
+    INPUT_KEY_DOWN = 1 << 5,
+    INPUT_KEY_LEFT = 1 << 6,
+    INPUT_KEY_RIGHT = 1 << 7,
+    // Page buttons (see shell.html)
+    INPUT_CHANGE_WALL_COLOR = 1 << 8,
+    INPUT_CHANGE_MAP_MODE = 1 << 9,
+    INPUT_EXTRACT_WALLS = 1 << 10,
+    INPUT_FLOOR_UP = 1 << 11,
+    INPUT_FLOOR_DOWN = 1 << 12,
+    INPUT_KEY_PAGE_UP = 1 << 13,
+    INPUT_KEY_PAGE_DOWN = 1 << 14
+} INPUTBIT;
+
+typedef struct InputFrame
+{
+    short mouseX;
+    short mouseY;
+    uint16_t bits;
+} INPUTFRAME;
+
+typedef enum INPUTMODE
+{
+    INPUT_LIVE,
+    INPUT_RECORDING,
+    INPUT_REPLAYING
+} INPUTMODE;
+INPUTMODE inputMode = INPUT_LIVE;
+
+INPUTFRAME frameInput;
+// Page buttons pressed since the last frame was polled
+uint16_t pendingInputCommands = 0;
+
+// Recorded / replayed frames
+INPUTFRAME *inputFrames = NULL;
+int inputFrameCount = 0;
+int inputFrameCapacity = 0;
+int inputReplayFrame = 0;
+
+const char *inputSessionPath = "session.dvin";
+
+// Session state the recording started from
+unsigned char *recordedSessionState = NULL;
+size_t recordedSessionStateSize = 0;
+// The session from before a replay, put back when it's done
+unsigned char *liveSessionState = NULL;
+size_t liveSessionStateSize = 0;
+
+// Replay frame timings
+double replayStartTime = 0;
+double replayFrameTimeMax = 0;
+
+// Everything UpdateDrawFrame changes, stored at the start of a recording
+// so the replay starts from exactly the same place
+typedef struct SessionField
+{
+    void *data;
+    size_t size;
+    // Arrays only partly in use: size is per element, the field before holds the (short) element count
+    short maxCount;
+} SESSIONFIELD;
+
+SESSIONFIELD sessionFields[] = {
+    {&gameBoardGridWidth, sizeof(gameBoardGridWidth)},
+    {&gameBoardGridHeight, sizeof(gameBoardGridHeight)},
+    {&tileSize, sizeof(tileSize)},
+    {&mousePositionXOld, sizeof(mousePositionXOld)},
+    {&mousePositionYOld, sizeof(mousePositionYOld)},
+    {&mapEditorMode, sizeof(mapEditorMode)},
+    {&wallPlacementStarted, sizeof(wallPlacementStarted)},
+    {&boxSelectionStarted, sizeof(boxSelectionStarted)},
+    {&wallColorToggle, sizeof(wallColorToggle)},
+    {walls, sizeof(walls)},
+    {&placeWallIndex, sizeof(placeWallIndex)},
+    {&selectedWallIndex, sizeof(selectedWallIndex)},
+    {tokens, sizeof(tokens)},
+    {&activeToken, sizeof(activeToken)},
+    {&drawFov, sizeof(drawFov)},
+    {&floorCount, sizeof(floorCount)},
+    {floorLayouts, sizeof(FLOORLAYOUT), MAX_FLOOR_COUNT},
+    {&currentFloor, sizeof(currentFloor)}};
+const short sessionFieldCount = sizeof(sessionFields) / sizeof(sessionFields[0]);
+
+// Input file: "DVIN", version, session state size, the session state run length encoded (see the PVS file),
+// then (frame, repeat count) pairs since most frames are the same as the one before
+const uint32_t inputFileMagic = 0x4E495644; // "DVIN"
+const uint32_t inputFileVersion = 3;
+
+static inline bool IsInputSet(INPUTBIT bit)
+{
+    return (frameInput.bits & bit) != 0;
+}
+
+// Page buttons call this so recordings see them on the next frame
+void RecordInputCommand(INPUTBIT command)
+{
+    if (inputMode == INPUT_RECORDING)
+        pendingInputCommands |= command;
+}
+
+bool AppendInputFrame(INPUTFRAME frame)
+{
+    if (inputFrameCount == inputFrameCapacity)
+    {
+        int capacity = max(inputFrameCapacity * 2, 1024);
+        INPUTFRAME *frames = realloc(inputFrames, capacity * sizeof(INPUTFRAME));
+        if (!frames)
+            return false;
+        inputFrames = frames;
+        inputFrameCapacity = capacity;
+    }
+    inputFrames[inputFrameCount++] = frame;
+    return true;
+}
+
+// Bytes a field takes, count points at the element count of an array field (false when it's out of range)
+bool SessionFieldSize(short field, const void *count, size_t *size)
+{
+    *size = sessionFields[field].size;
+    if (!sessionFields[field].maxCount)
+        return true;
 
-// Distance from a point to be considered as the point
-int mouseSensitivityDistance = 6;
-// Mouse position
-int mousePositionX = 0;
-int mousePositionY = 0;
-int mousePositionXOld = 0;
-int mousePositionYOld = 0;
+    short elements;
+    memcpy(&elements, count, sizeof(elements));
+    *size *= elements;
+    return elements >= 0 && elements <= sessionFields[field].maxCount;
+}
 
-// If the mouse is over a corner/wall node
-bool isMouseOverCorner = false;
+// Largest a state can get, with every array full
+size_t MaxSessionStateSize()
+{
+    size_t size = 0;
+    for (short i = 0; i < sessionFieldCount; i++)
+    {
+        size += sessionFields[i].size * max(sessionFields[i].maxCount, 1);
+    }
+    return size;
+}
 
-// Read the name
-typedef enum MAPEDITORMODE
+// Copy every session field into one buffer, in table order (zero padded to whole words for the file)
+unsigned char *CaptureSessionState(size_t *size)
 {
-    MAP_NONE,
-    MAP_PLACEWALLS,
-    MAP_PLAY
-} MAPEDITORMODE;
-MAPEDITORMODE mapEditorMode = MAP_PLACEWALLS;
+    *size = 0;
+    for (short i = 0; i < sessionFieldCount; i++)
+    {
+        size_t fieldSize;
+        SessionFieldSize(i, sessionFields[i].maxCount ? sessionFields[i - 1].data : NULL, &fieldSize);
+        *size += fieldSize;
+    }
+    unsigned char *state = calloc((*size + 3) / 4, 4);
+    if (!state)
+        return NULL;
 
-// If the first vertex of a wall has been placed
-bool wallPlacementStarted = false;
-// If box selection has been started
-bool boxSelectionStarted = false;
+    unsigned char *cursor = state;
+    for (short i = 0; i < sessionFieldCount; i++)
+    {
+        size_t fieldSize;
+        SessionFieldSize(i, sessionFields[i].maxCount ? sessionFields[i - 1].data : NULL, &fieldSize);
+        memcpy(cursor, sessionFields[i].data, fieldSize);
+        cursor += fieldSize;
+    }
+    return state;
+}
 
-typedef enum WALLSTATE
+// If a buffer holds exactly one state, array counts in range
+bool IsSessionStateValid(const unsigned char *state, size_t size)
 {
-    WALL_NONE,
-    WALL_PLACED,
-    WALL_MARKED
-} WALLSTATE;
+    size_t offset = 0;
+    for (short i = 0; i < sessionFieldCount; i++)
+    {
+        // An array's count was stored just before it
+        size_t fieldSize;
+        if ((sessionFields[i].maxCount && offset < sizeof(short)) ||
+            !SessionFieldSize(i, sessionFields[i].maxCount ? state + offset - sizeof(short) : NULL, &fieldSize) ||
+            fieldSize > size - offset)
+            return false;
+        offset += fieldSize;
+    }
+    return offset == size;
+}
 
-// Wall struct
-typedef struct Wall
+bool RestoreSessionState(const unsigned char *state, size_t size)
 {
-    WALLSTATE state;
-    short startX;
-    short startY;
-    short endX;
-    short endY;
-} WALL;
-
-// Wall color
-bool wallColorToggle = true;
+    if (!IsSessionStateValid(state, size))
+        return false;
 
-// Wall variable
-const short maxWallCount = 512;
-WALL walls[512];
-short placeWallIndex = 0;
-short selectedWallIndex = -1;
+    for (short i = 0; i < sessionFieldCount; i++)
+    {
+        // An array's count has just been restored
+        size_t fieldSize;
+        SessionFieldSize(i, sessionFields[i].maxCount ? sessionFields[i - 1].data : NULL, &fieldSize);
+        memcpy(sessionFields[i].data, state, fieldSize);
+        state += fieldSize;
+    }
+    return true;
+}
 
-// Bitwise boolean conditions array
-typedef enum BITCONDITION
+bool StartInputRecording()
 {
-    CON_DEAD = 1,
-    CON_BLIND = 1 << 1,
-    CON_CHARMED = 1 << 2,
-    CON_DEAFENED = 1 << 3,
-    CON_FRIGHTENED = 1 << 4,
-    CON_GRAPPLED = 1 << 5,
-    CON_INCAPACITATED = 1 << 6,
-    CON_INVISIBLE = 1 << 7,
-    CON_PARALYZED = 1 << 8,
-    CON_PETRIFIED = 1 << 9,
-    CON_POISONED = 1 << 10,
-    CON_PRONE = 1 << 11,
-    CON_RESTRAINED = 1 << 12,
-    CON_STUNNED = 1 << 13,
-    CON_UNCONSCIOUS = 1 << 14,
-    CON_EXTRA_01 = 1 << 15,
-    CON_EXTRA_02 = 1 << 16,
-    CON_EXTRA_03 = 1 << 17,
-    CON_EXTRA_04 = 1 << 18,
-    CON_EXTRA_05 = 1 << 19,
-    CON_EXTRA_06 = 1 << 20,
-    CON_EXTRA_07 = 1 << 21,
-    CON_EXTRA_08 = 1 << 22,
-    CON_EXTRA_09 = 1 << 23,
-    CON_EXTRA_10 = 1 << 24,
-    CON_EXTRA_11 = 1 << 25,
-    CON_EXTRA_12 = 1 << 26,
-    CON_EXTRA_13 = 1 << 27,
-    CON_EXTRA_14 = 1 << 28,
-    CON_EXTRA_15 = 1 << 29,
-    CON_EXTRA_16 = 1 << 30,
-    CON_EXTRA_17 = 1 << 31
-} BITCONDITION;
+    if (inputMode != INPUT_LIVE)
+        return false;
 
-typedef enum TOKENSTATE
+    free(recordedSessionState);
+    recordedSessionState = CaptureSessionState(&recordedSessionStateSize);
+    if (!recordedSessionState)
+        return false;
+
+    inputFrameCount = 0;
+    pendingInputCommands = 0;
+    inputMode = INPUT_RECORDING;
+    return true;
+}
+
+bool SaveInputFrames(const char *path)
 {
-    TOKEN_NONE,
-    TOKEN_PLACED,
-    TOKEN_HOVER,
-    TOKEN_SELECTED
-} TOKENSTATE;
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
 
-// Token struct
-typedef struct Token
+    fwrite(&inputFileMagic, sizeof(inputFileMagic), 1, file);
+    fwrite(&inputFileVersion, sizeof(inputFileVersion), 1, file);
+    uint32_t stateSize = (uint32_t)recordedSessionStateSize;
+    fwrite(&stateSize, sizeof(stateSize), 1, file);
+    WriteRunLengthWords(file, (const uint32_t *)recordedSessionState, (recordedSessionStateSize + 3) / 4);
+
+    int i = 0;
+    while (i < inputFrameCount)
+    {
+        uint16_t repeat = 1;
+        while (i + repeat < inputFrameCount && repeat < UINT16_MAX &&
+               memcmp(&inputFrames[i + repeat], &inputFrames[i], sizeof(INPUTFRAME)) == 0)
+        {
+            repeat++;
+        }
+        fwrite(&inputFrames[i], sizeof(INPUTFRAME), 1, file);
+        fwrite(&repeat, sizeof(repeat), 1, file);
+        i += repeat;
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool StopInputRecording(const char *path)
 {
-    TOKENSTATE state;
-    short x;
-    short y;
-    char width;
-    char height;
-    uint32_t bitConditions;
-    Color color;
-} TOKEN;
+    if (inputMode != INPUT_RECORDING)
+        return false;
 
-// Token variable
-const short maxTokenCount = 512;
-TOKEN tokens[512];
-short activeToken = -1;
+    inputMode = INPUT_LIVE;
+    bool saved = SaveInputFrames(path);
+    printf("Recorded %d frames to %s\n", inputFrameCount, path);
+    return saved;
+}
 
-bool drawFov = true;
+bool LoadInputFrames(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
 
-// Map texture
-Texture2D mapTexture;
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t stateSize = 0;
+    unsigned char *state = NULL;
+    bool ok =
+        fread(&magic, sizeof(magic), 1, file) == 1 && magic == inputFileMagic &&
+        fread(&version, sizeof(version), 1, file) == 1 && version == inputFileVersion &&
+        fread(&stateSize, sizeof(stateSize), 1, file) == 1 && stateSize <= MaxSessionStateSize() &&
+        (state = calloc((stateSize + 3) / 4, 4)) != NULL &&
+        ReadRunLengthWords(file, (uint32_t *)state, (stateSize + 3) / 4) &&
+        IsSessionStateValid(state, stateSize);
+
+    inputFrameCount = 0;
+    INPUTFRAME frame;
+    uint16_t repeat;
+    while (ok &&
+           fread(&frame, sizeof(frame), 1, file) == 1 &&
+           fread(&repeat, sizeof(repeat), 1, file) == 1)
+    {
+        for (uint16_t i = 0; i < repeat && ok; i++)
+        {
+            ok = AppendInputFrame(frame);
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        free(state);
+        return false;
+    }
+    free(recordedSessionState);
+    recordedSessionState = state;
+    recordedSessionStateSize = stateSize;
+    return true;
+}
 
-inline int max(int a, int b)
+bool StartInputReplay(const char *path)
 {
-    return (a > b) * a + (a <= b) * b;
+    if (inputMode != INPUT_LIVE || !LoadInputFrames(path) || inputFrameCount == 0)
+        return false;
+
+    free(liveSessionState);
+    liveSessionState = CaptureSessionState(&liveSessionStateSize);
+    if (!liveSessionState)
+        return false;
+
+    // Anything still being worked on belongs to the state we're about to replace
+    WaitForVisibilityWorker();
+    FlushFloorCaches();
+    RestoreSessionState(recordedSessionState, recordedSessionStateSize);
+    ShowCurrentFloor();
+    // The PVS and rooms may belong to other walls now
+    RefreshVisibilityData();
+
+    inputReplayFrame = 0;
+    replayStartTime = ProfileTime();
+    replayFrameTimeMax = 0;
+    inputMode = INPUT_REPLAYING;
+    return true;
 }
 
-inline int min(int a, int b)
+void FinishInputReplay()
 {
-    return (a < b) * a + (a >= b) * b;
+    double total = ProfileTime() - replayStartTime;
+    printf("Replayed %d frames in %.3fs, %.3fms per frame, %.3fms slowest\n",
+           inputFrameCount, total,
+           inputFrameCount ? total * 1000.0 / inputFrameCount : 0.0,
+           replayFrameTimeMax * 1000.0);
+    inputMode = INPUT_LIVE;
+
+    // Back to the session the replay took over from
+    WaitForVisibilityWorker();
+    FlushFloorCaches();
+    RestoreSessionState(liveSessionState, liveSessionStateSize);
+    free(liveSessionState);
+    liveSessionState = NULL;
+    ShowCurrentFloor();
+    RefreshVisibilityData();
 }
 
-// Point rectangle collision
-inline bool PointRectCollision(int x, int y, int rx, int ry, int rx2, int ry2)
+// Fill frameInput for this frame from the mouse/keyboard or the replay
+void PollInput()
 {
-    return x >= min(rx, rx2) &&
-           x <= max(rx, rx2) &&
-           y >= min(ry, ry2) &&
-           y <= max(ry, ry2);
+    if (inputMode == INPUT_REPLAYING)
+    {
+        frameInput = inputFrames[inputReplayFrame++];
+
+        // Page buttons happened before the frame they were recorded in
+        if (IsInputSet(INPUT_CHANGE_WALL_COLOR))
+            ToggleWallColor();
+        if (IsInputSet(INPUT_CHANGE_MAP_MODE))
+            ToggleMapMode();
+        if (IsInputSet(INPUT_EXTRACT_WALLS))
+            DetectWallsFromMap();
+        if (IsInputSet(INPUT_FLOOR_UP))
+            SwitchFloor(currentFloor + 1);
+        if (IsInputSet(INPUT_FLOOR_DOWN))
+            SwitchFloor(currentFloor - 1);
+        return;
+    }
+
+    frameInput.mouseX = GetMouseX();
+    frameInput.mouseY = GetMouseY();
+    frameInput.bits =
+        IsMouseButtonPressed(MOUSE_LEFT_BUTTON) * INPUT_LEFT_PRESSED |
+        IsMouseButtonPressed(MOUSE_BUTTON_RIGHT) * INPUT_RIGHT_PRESSED |
+        IsMouseButtonDown(MOUSE_BUTTON_RIGHT) * INPUT_RIGHT_DOWN |
+        IsMouseButtonReleased(MOUSE_BUTTON_RIGHT) * INPUT_RIGHT_RELEASED |
+        IsKeyPressed(KEY_UP) * INPUT_KEY_UP |
+        IsKeyPressed(KEY_DOWN) * INPUT_KEY_DOWN |
+        IsKeyPressed(KEY_LEFT) * INPUT_KEY_LEFT |
+        IsKeyPressed(KEY_RIGHT) * INPUT_KEY_RIGHT |
+        IsKeyPressed(KEY_PAGE_UP) * INPUT_KEY_PAGE_UP |
+        IsKeyPressed(KEY_PAGE_DOWN) * INPUT_KEY_PAGE_DOWN |
+        pendingInputCommands;
+    pendingInputCommands = 0;
+
+    if (inputMode == INPUT_RECORDING && !AppendInputFrame(frameInput))
+    {
+        // Out of memory, keep what we have
+        StopInputRecording(inputSessionPath);
+    }
 }
 
-inline Vector2 FoVEndpoint(short x, short y)
+// Frame timing for the replay report, and stop once the input runs out
+void EndReplayFrame(double frameStartTime)
 {
-    return (Vector2){
-        x + (gameBoardGridWidth + gameBoardGridHeight) * (x - tokens[activeToken].x - 0.5 * tokens[activeToken].width),
-        y + (gameBoardGridWidth + gameBoardGridHeight) * (y - tokens[activeToken].y - 0.5 * tokens[activeToken].height)};
+    if (inputMode != INPUT_REPLAYING)
+        return;
+
+    double frameTime = ProfileTime() - frameStartTime;
+    replayFrameTimeMax = frameTime > replayFrameTimeMax ? frameTime : replayFrameTimeMax;
+    if (inputReplayFrame >= inputFrameCount)
+        FinishInputReplay();
 }
 
 // Game loop
 void UpdateDrawFrame()
 {
+    double frameStartTime = ProfileTime();
+
     // Update variables
-    mousePositionX = GetMouseX();
-    mousePositionY = GetMouseY();
+    PollInput();
+    UpdateFloorCache();
+
+    if (IsInputSet(INPUT_KEY_PAGE_UP))
+        SwitchFloor(currentFloor + 1);
+    if (IsInputSet(INPUT_KEY_PAGE_DOWN))
+        SwitchFloor(currentFloor - 1);
+
+    mousePositionX = frameInput.mouseX;
+    mousePositionY = frameInput.mouseY;
 
     int mouseGridPosX = (int)round(mousePositionX / tileSize);
     int mouseGridPosY = (int)round(mousePositionY / tileSize);
@@ -263,7 +2828,7 @@ void UpdateDrawFrame()
             }
         }
 
-        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON))
+        if (IsInputSet(INPUT_LEFT_PRESSED))
         {
             if (isMouseOverCorner)
             {
@@ -330,7 +2895,7 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
+        if (IsInputSet(INPUT_RIGHT_PRESSED))
         {
             if (wallPlacementStarted)
             {
@@ -341,7 +2906,7 @@ void UpdateDrawFrame()
             mousePositionXOld = mousePositionX;
             mousePositionYOld = mousePositionY;
         }
-        if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT) && !boxSelectionStarted)
+        if (IsInputSet(INPUT_RIGHT_DOWN) && !boxSelectionStarted)
         {
             if (abs(mousePositionX - mousePositionXOld) > mouseSensitivityDistance ||
                 abs(mousePositionY - mousePositionYOld) > mouseSensitivityDistance)
@@ -349,7 +2914,7 @@ void UpdateDrawFrame()
                 boxSelectionStarted = true;
             }
         }
-        if (IsMouseButtonReleased(MOUSE_BUTTON_RIGHT))
+        if (IsInputSet(INPUT_RIGHT_RELEASED))
         {
             if (boxSelectionStarted)
             {
@@ -428,12 +2993,12 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
+        if (IsInputSet(INPUT_RIGHT_PRESSED))
         {
             mousePositionXOld = mousePositionX;
             mousePositionYOld = mousePositionY;
         }
-        if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT) && !boxSelectionStarted)
+        if (IsInputSet(INPUT_RIGHT_DOWN) && !boxSelectionStarted)
         {
             if (abs(mousePositionX - mousePositionXOld) > mouseSensitivityDistance ||
                 abs(mousePositionY - mousePositionYOld) > mouseSensitivityDistance)
@@ -441,7 +3006,7 @@ void UpdateDrawFrame()
                 boxSelectionStarted = true;
             }
         }
-        if (IsMouseButtonReleased(MOUSE_BUTTON_RIGHT))
+        if (IsInputSet(INPUT_RIGHT_RELEASED))
         {
             if (boxSelectionStarted)
             {
@@ -481,7 +3046,7 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsKeyPressed(KEY_UP))
+        if (IsInputSet(INPUT_KEY_UP))
         {
             for (short i = 0; i < maxTokenCount; i++)
             {
@@ -491,7 +3056,7 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsKeyPressed(KEY_DOWN))
+        if (IsInputSet(INPUT_KEY_DOWN))
         {
             for (short i = 0; i < maxTokenCount; i++)
             {
@@ -501,7 +3066,7 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsKeyPressed(KEY_LEFT))
+        if (IsInputSet(INPUT_KEY_LEFT))
         {
             for (short i = 0; i < maxTokenCount; i++)
             {
@@ -511,7 +3076,7 @@ void UpdateDrawFrame()
                 }
             }
         }
-        if (IsKeyPressed(KEY_RIGHT))
+        if (IsInputSet(INPUT_KEY_RIGHT))
         {
             for (short i = 0; i < maxTokenCount; i++)
             {
@@ -527,10 +3092,20 @@ void UpdateDrawFrame()
         break;
     }
 
+    UpdatePotentiallyVisibleSetBuild(pvsBuildFrameTime);
+    UpdateVisibility();
+
+    // Nothing to draw to in a headless replay
+    if (headless)
+    {
+        EndReplayFrame(frameStartTime);
+        return;
+    }
+
     BeginDrawing();
     ClearBackground(RAYWHITE);
 
-    DrawTextureEx(mapTexture, (Vector2){0, 0}, 0, 0.5, WHITE);
+    DrawTextureEx(mapTexture, (Vector2){0, 0}, 0, mapTextureScale, WHITE);
 
     // Draw Tokens
     for (short i = 0; i < maxTokenCount; i++)
@@ -641,35 +3216,15 @@ void UpdateDrawFrame()
         }
     }
 
-    // Draw FoV shadows
+    // Draw FoV shadows (whatever the pipeline last published)
     if (drawFov && activeToken != -1)
     {
-        for (short i = 0; i < maxWallCount; i++)
+        const VISIBILITYRESULT *visibility = &visibilityResults[atomic_load(&visibilityFrontIndex)];
+        for (short i = 0; i < visibility->quadCount; i++)
         {
-            if (!walls[i].state)
-                continue;
-
-            Vector2 a = (Vector2){
-                walls[i].startX,
-                walls[i].startY};
-            Vector2 b = (Vector2){
-                walls[i].endX,
-                walls[i].endY};
-            Vector2 c = FoVEndpoint(walls[i].startX, walls[i].startY);
-            Vector2 d = FoVEndpoint(walls[i].endX, walls[i].endY);
-
-            if ( (b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x) > 0.0f )
-            {
-                // clockwise
-                DrawTriangle( Vector2Scale(a, tileSize), Vector2Scale(c, tileSize), Vector2Scale(d, tileSize), BLACK);
-                DrawTriangle( Vector2Scale(a, tileSize), Vector2Scale(d, tileSize), Vector2Scale(b, tileSize), BLACK);
-            }
-            else
-            {
-                // counter-clockwise.
-                DrawTriangle( Vector2Scale(a, tileSize), Vector2Scale(d, tileSize), Vector2Scale(c, tileSize), BLACK);
-                DrawTriangle( Vector2Scale(a, tileSize), Vector2Scale(b, tileSize), Vector2Scale(d, tileSize), BLACK);
-            }
+            const SHADOWQUAD *quad = &visibility->quads[i];
+            DrawTriangle(quad->points[0], quad->points[1], quad->points[2], BLACK);
+            DrawTriangle(quad->points[0], quad->points[2], quad->points[3], BLACK);
         }
     }
 
@@ -695,30 +3250,52 @@ void UpdateDrawFrame()
     // DrawText(TextFormat("%d", activeToken), 10, 150, 50, RED);
 
     EndDrawing();
+
+    EndReplayFrame(frameStartTime);
 }
 
 EMSCRIPTEN_KEEPALIVE
 bool ChangeWallColor()
 {
-    wallColorToggle = !wallColorToggle;
-    return wallColorToggle;
+    // The replay presses the buttons itself
+    if (inputMode == INPUT_REPLAYING)
+        return wallColorToggle;
+
+    RecordInputCommand(INPUT_CHANGE_WALL_COLOR);
+    return ToggleWallColor();
 }
 
 EMSCRIPTEN_KEEPALIVE
 bool ChangeMapMode()
 {
-    if (mapEditorMode == MAP_PLACEWALLS)
-    {
-        mapEditorMode = MAP_PLAY;
-        boxSelectionStarted = false;
-        return true;
-    }
-    else
-    {
-        mapEditorMode = MAP_PLACEWALLS;
-        boxSelectionStarted = false;
-        return false;
-    }
+    if (inputMode == INPUT_REPLAYING)
+        return mapEditorMode == MAP_PLAY;
+
+    RecordInputCommand(INPUT_CHANGE_MAP_MODE);
+    return ToggleMapMode();
+}
+
+// Move up (delta > 0) or down a floor, returns the floor now shown
+EMSCRIPTEN_KEEPALIVE
+int ChangeFloor(int delta)
+{
+    if (delta == 0 || inputMode == INPUT_REPLAYING)
+        return currentFloor;
+
+    RecordInputCommand(delta > 0 ? INPUT_FLOOR_UP : INPUT_FLOOR_DOWN);
+    SwitchFloor(currentFloor + (delta > 0 ? 1 : -1));
+    return currentFloor;
+}
+
+// Add a floor above the others, returns its index or -1
+EMSCRIPTEN_KEEPALIVE
+int AddMapFloor(const char *imagePath, int gridWidth, int gridHeight)
+{
+    // Replays can't reproduce this (session state is only stored at the start)
+    if (inputMode != INPUT_LIVE || !FileExists(imagePath))
+        return -1;
+
+    return AddFloor(imagePath, gridWidth, gridHeight);
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -734,8 +3311,63 @@ bool PrintWalls()
     return true;
 }
 
-int main()
+EMSCRIPTEN_KEEPALIVE
+int ExtractWalls()
+{
+    if (inputMode == INPUT_REPLAYING)
+        return 0;
+
+    RecordInputCommand(INPUT_EXTRACT_WALLS);
+    return DetectWallsFromMap();
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool SavePvs()
+{
+    // Asked for it, so finish the build now, here even if the worker is on it
+    RefreshPotentiallyVisibleSet();
+    if (!IsPvsUsable(&pvs, HashWalls(walls), gameBoardGridWidth, gameBoardGridHeight) && !pvsBuild.active)
+        StartPotentiallyVisibleSetBuild(&pvsBuild, walls, gameBoardGridWidth, gameBoardGridHeight);
+    UpdatePotentiallyVisibleSetBuild(-1);
+    if (!SavePotentiallyVisibleSet(&pvs, mapPvsPath))
+        return false;
+
+#ifdef __EMSCRIPTEN__
+    // Hand the file to the browser (see shell.html)
+    emscripten_run_script(TextFormat("saveFileFromMEMFSToDisk('%s', '%s')", mapPvsPath, GetFileName(mapPvsPath)));
+#endif
+    return true;
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool RecordInput()
+{
+    return StartInputRecording();
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool StopRecordingInput()
+{
+    if (!StopInputRecording(inputSessionPath))
+        return false;
+
+#ifdef __EMSCRIPTEN__
+    emscripten_run_script(TextFormat("saveFileFromMEMFSToDisk('%s', '%s')", inputSessionPath, GetFileName(inputSessionPath)));
+#endif
+    return true;
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool ReplayInput()
+{
+    return StartInputReplay(inputSessionPath);
+}
+
+int main(int argc, char **argv)
 {
+    // The default map is the first floor
+    currentFloor = AddFloor(mapImagePath, gameBoardGridWidth, gameBoardGridHeight);
+
     for (short i = 0; i < maxWallCount; i++)
     {
         walls[i].state = WALL_NONE;
@@ -789,21 +3421,59 @@ int main()
         tokens[i].color = PINK;
     }
 
-    InitWindow(screenWidth, screenHeight, "raylib [core] example - basic window");
+#ifndef __EMSCRIPTEN__
+    // Native command line (see the compilation notes at the top)
+    const char *replayPath = NULL;
+    const char *recordPath = NULL;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--replay") == 0)
+            replayPath = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0)
+            recordPath = argv[++i];
+    }
+    // Headless, no window or GL context and as fast as it will go
+    headless = replayPath != NULL;
+#endif
 
-    mapTexture = LoadTexture("mapImages/The_handy_hag_upstairs.png");
+    if (!headless)
+        InitWindow(screenWidth, screenHeight, "raylib [core] example - basic window");
 
-    screenWidth = mapTexture.width / 2;
-    screenHeight = mapTexture.height / 2;
+    ShowCurrentFloor();
 
-    SetWindowSize(screenWidth, screenHeight);
+    // Use the saved PVS if it was made for these walls, otherwise it gets rebuilt when play starts
+    if (!LoadPotentiallyVisibleSet(&pvs, mapPvsPath) ||
+        !IsPvsUsable(&pvs, HashWalls(walls), gameBoardGridWidth, gameBoardGridHeight))
+    {
+        FreePotentiallyVisibleSet(&pvs);
+    }
 
-    tileSize =
-        (screenWidth / gameBoardGridWidth) * (screenWidth <= screenHeight) +
-        (screenHeight / gameBoardGridHeight) * (screenWidth > screenHeight);
+    StartVisibilityWorker();
+    StartFloorPrefetchWorker();
 
+#ifdef __EMSCRIPTEN__
     // Start the main loop
     emscripten_set_main_loop(UpdateDrawFrame, 0, 1);
+#else
+    if (replayPath && !StartInputReplay(replayPath))
+    {
+        printf("Could not replay %s\n", replayPath);
+        return 1;
+    }
+    if (recordPath)
+        StartInputRecording();
+
+    // Headless replays quit once the input runs out
+    while (headless ? inputMode == INPUT_REPLAYING : !WindowShouldClose())
+    {
+        UpdateDrawFrame();
+    }
+
+    if (recordPath)
+        StopInputRecording(recordPath);
+    if (!headless)
+        CloseWindow();
+#endif
 
     return 0;
 }
\ No newline at end of file